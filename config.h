@@ -48,6 +48,19 @@ public:
     int ef_search = 400;
     int ef_search_upper = 1;
     int k_upper = 1;
+    const bool use_centroid_entry_points = false;  // Seed query search at layer 0 from a k-means centroid table instead of descending the upper layers
+    int num_centroids = 1024;  // Only used if use_centroid_entry_points = true, each scan costs this many distance computations
+    int num_centroid_entry_points = 4;  // Representatives of the nearest centroids used as layer-0 entry points
+    int centroid_iterations = 8;  // K-means iterations over a sample of 16 nodes per centroid
+
+    // Vamana Construction, searches share ef_search and num_threads with HNSW
+    float vamana_alpha = 1.2;  // Occlusion factor of the second pass, the first pass uses 1
+    int vamana_max_connections = 50;  // Max out-degree R
+    int vamana_ef_construction = 30;  // Beam width L of construction searches
+    int vamana_num_starts = 1;  // Search start points, taken nearest to k-means centroids when above 1
+    int vamana_kmeans_iterations = 10;  // Only used if vamana_num_starts > 1
+    float vamana_max_batch_fraction = 0.02;  // Largest parallel insertion batch as a fraction of the nodes
+    std::string loaded_vamana_graph_file = "";  // Only used by benchmark comparisons if load_graph_file = true, built if empty
 
     // Termination Parameters
     const bool use_distance_termination = false;
@@ -101,6 +114,7 @@ public:
     const bool use_direct_path = false;
     const bool use_dynamic_sampling = false;
     const bool use_stinky_points = false;
+    const bool use_incremental_grasp = false;  // Reuse each training point's searches until an edge they expanded flips its ignore state
     float stinky_value = 0.00005;
     float learning_rate = 0.1;
     float initial_temperature = 1;
@@ -108,19 +122,37 @@ public:
     int keep_exponent = 3;
     int grasp_loops = 20;
     int grasp_subloops = 1;
+    int grasp_batch_size = 0;  // Training queries per weight update, each on a newly normalized and sampled subgraph, 0 = whole training set
     int weight_selection_method = 0;  // 0 = all edges on original path, 1 = only ignored edges, 2 = exclude edges on sample path
     int weight_formula = 0;  // 0 = ratio of average distances, 1 = average of distance ratios, 2 = discounted cumulative gain
     float initial_keep_ratio = 0.9;
     float final_keep_ratio = 0.7;
     int initial_cost = 0;
     int initial_benefit = 0;
-    
+
+    // Query-Time Layout
+    const bool use_inline_layout = false;  // Search layer 0 through records holding neighbor IDs and product-quantized neighbor codes
+    const bool export_inline_layout = false;  // Export the inline layout after construction and pruning
+    int inline_pq_subspaces = 16;  // Bytes per neighbor code in the inline layout, each coding a slice of the dimensions with 256 centroids trained for centroid_iterations
+    int reorder_method = 0;  // 0 = none, 1 = BFS from entry point, 2 = reverse Cuthill-McKee, 3 = Gorder
+    int gorder_window = 5;  // Only used if reorder_method = 3
+
+    // Memory Placement
+    const bool use_huge_pages = false;  // Back the vector slab and flat index arrays with 2MB pages, falling back to transparent huge pages
+    const bool compare_huge_pages = false;  // Also benchmark QPS with the index copied onto the other page size, keeping 4KB pages when huge pages are off
+    int numa_policy = 0;  // 0 = first touch, 1 = interleave all index memory across NUMA nodes, 2 = replicate the index on every node
+
+    // Parallelism
+    int num_threads = 1;  // Threads for GraSP training and query search (pinned round-robin across NUMA nodes), 0 = one per CPU
+    const bool benchmark_numa_scaling = false;  // Also report QPS with a worker pool on each NUMA node, then on all nodes
+
     // Grid parameters: repeat all benchmarks for each set of grid values
     std::vector<int> grid_num_return = {}; 
     std::vector<std::string> grid_runs_prefix = {};
     std::vector<std::string> grid_graph_file = {};
     
     // Benchmark parameters
+    const bool benchmark_compare_indexes = false;  // First build HNSW and Vamana and search both with the same queries and threads
     std::vector<int> benchmark_num_return = {};
     std::vector<int> benchmark_optimal_connections = {};
     std::vector<int> benchmark_max_connections = {};
@@ -136,6 +168,7 @@ public:
     std::vector<float> benchmark_stinky_points = {};
     std::vector<int> benchmark_grasp_loops = {};
     std::vector<int> benchmark_grasp_subloops = {};
+    std::vector<int> benchmark_grasp_batch_size = {};
     std::vector<int> benchmark_calculations_per_query = {};
     std::vector<int> benchmark_oracle_termination_total = {};
 
@@ -149,6 +182,7 @@ public:
     const bool export_clustering_coefficient = false;
     const bool export_cost_benefit_pruned = false;  // Log edges pruned by cost-benefit training
     const bool export_calcs_per_query = false;  // Log distance calcs performed during search
+    const bool export_latency_per_query = false;  // Log search latency of each query
     const bool export_training_queries = false; 
     const bool export_negative_values = false; 
     const bool print_weight_updates = true;
@@ -160,6 +194,7 @@ public:
     int interval_for_cost_histogram = 10; 
     int interval_for_benefit_histogram = 1; 
     int interval_for_calcs_histogram = 1000;
+    int interval_for_latency_histogram = 50;  // Microseconds
 
     // Generation Settings
     std::string training_set = "";
@@ -223,6 +258,14 @@ public:
             ef_construction = num_nodes;
             std::cout << "Warning: Beam width was set to " << num_nodes << std::endl;
         }
+        if (use_incremental_grasp && (use_dynamic_sampling || use_stinky_points || use_direct_path)) {
+            std::cout << "Incremental GraSP cannot be used with dynamic sampling, stinky points, or direct paths" << std::endl;
+            return false;
+        }
+        if (inline_pq_subspaces < 1) {
+            std::cout << "Inline layout needs at least one subspace" << std::endl;
+            return false;
+        }
         if (num_return > ef_search) {
             num_return = ef_search;
             std::cout << "Warning: Number of queries to return was set to " << ef_search << std::endl;
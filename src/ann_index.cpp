@@ -0,0 +1,143 @@
+#include <iostream>
+#include <limits>
+#include <omp.h>
+#include "ann_index.h"
+
+using namespace std;
+
+HNSWIndex::HNSWIndex(Config* config, float** nodes) : hnsw(new HNSW(config, nodes)) {}
+
+HNSWIndex::~HNSWIndex() {
+    delete hnsw;
+}
+
+void HNSWIndex::build(Config* config) {
+    for (int i = 1; i < config->num_nodes; ++i) {
+        hnsw->insert(config, i);
+    }
+    hnsw->pair_distances.clear();  // Only used while inserting
+    if (config->use_centroid_entry_points) {
+        hnsw->build_centroid_table(config);
+    }
+}
+
+// Node 0 is linked by the constructor
+void HNSWIndex::add(Config* config, int node) {
+    if (node != 0) {
+        hnsw->insert(config, node);
+    }
+}
+
+vector<pair<float, int>> HNSWIndex::search(Config* config, float* query, int num_to_return) {
+    // Unnumbered queries never match config->debug_query_search_index
+    vector<Edge*> path;
+    pair<int, float*> query_pair = make_pair(numeric_limits<int>::max(), query);
+    return hnsw->nn_search(config, path, query_pair, num_to_return);
+}
+
+vector<vector<pair<float, int>>> HNSWIndex::batch_search(Config* config, float** queries, int num_queries, int num_to_return) {
+    vector<vector<pair<float, int>>> results(num_queries);
+    int num_threads = config->num_threads > 0 ? config->num_threads : omp_get_num_procs();
+    hnsw->parallel_for(num_queries, num_threads, {}, [&](int i, int thread) {
+        vector<Edge*> path;
+        pair<int, float*> query_pair = make_pair(i, queries[i]);
+        results[i] = hnsw->nn_search(config, path, query_pair, num_to_return);
+    });
+    return results;
+}
+
+void HNSWIndex::save(Config* config, const string& graph_name) {
+    hnsw->to_files(config, graph_name);
+}
+
+void HNSWIndex::load(Config* config) {
+    hnsw->from_files(config, true);
+    if (config->use_centroid_entry_points) {
+        hnsw->build_centroid_table(config);
+    }
+}
+
+SearchStatistics HNSWIndex::get_statistics() const {
+    return hnsw->get_statistics();
+}
+
+void HNSWIndex::reset_statistics() {
+    hnsw->reset_statistics();
+}
+
+// Snapshot of the Vamana search counters on the calling thread
+static SearchStatistics get_vamana_counters() {
+    SearchStatistics counters;
+    counters.layer0_dist_comps = distanceCalculationCount;
+    counters.candidates_popped = hopCount;
+    counters.num_distance_termination = distanceTerminationCount;
+    counters.num_original_termination = originalTerminationCount;
+    return counters;
+}
+
+// Adds the Vamana search counters moved on the calling thread since before to statistics
+static void add_vamana_counters(SearchStatistics& statistics, const SearchStatistics& before) {
+    SearchStatistics after = get_vamana_counters();
+    statistics.layer0_dist_comps += after.layer0_dist_comps - before.layer0_dist_comps;
+    statistics.candidates_popped += after.candidates_popped - before.candidates_popped;
+    statistics.num_distance_termination += after.num_distance_termination - before.num_distance_termination;
+    statistics.num_original_termination += after.num_original_termination - before.num_original_termination;
+}
+
+VamanaIndex::VamanaIndex(Config* config, float** nodes) : graph(config, nodes, config->vamana_max_connections) {}
+
+void VamanaIndex::build(Config* config) {
+    buildVamana(config, graph, config->vamana_alpha, config->vamana_ef_construction);
+}
+
+void VamanaIndex::add(Config* config, int node) {
+    if (graph.starts.empty()) {
+        graph.starts.push_back(node);
+        return;
+    }
+    insertVamana(graph, node, config->vamana_alpha, config->vamana_ef_construction);
+}
+
+vector<pair<float, int>> VamanaIndex::search(Config* config, float* query, int num_to_return) {
+    SearchStatistics before = get_vamana_counters();
+    vector<pair<float, int>> result = search_graph(config, query, num_to_return);
+    add_vamana_counters(statistics, before);
+    return result;
+}
+
+vector<vector<pair<float, int>>> VamanaIndex::batch_search(Config* config, float** queries, int num_queries, int num_to_return) {
+    vector<vector<pair<float, int>>> results(num_queries);
+    int num_threads = config->num_threads > 0 ? config->num_threads : omp_get_num_procs();
+    #pragma omp parallel num_threads(num_threads)
+    {
+        SearchStatistics before = get_vamana_counters();
+        #pragma omp for schedule(dynamic, 16)
+        for (int i = 0; i < num_queries; ++i) {
+            results[i] = search_graph(config, queries[i], num_to_return);
+        }
+        SearchStatistics counted;
+        add_vamana_counters(counted, before);
+        #pragma omp critical
+        statistics.add(counted);
+    }
+    return results;
+}
+
+void VamanaIndex::save(Config* config, const string& graph_name) {
+    graph.to_files(config, graph_name);
+}
+
+void VamanaIndex::load(Config* config) {
+    graph.from_files(config, true);
+}
+
+// Beam searches from the graph's start points with the configured termination mode and returns the closest num_to_return pooled nodes
+vector<pair<float, int>> VamanaIndex::search_graph(Config* config, float* query, int num_to_return) {
+    vector<float> distances;
+    vector<size_t> ids = GreedySearch(graph, graph.starts, query, max(config->ef_search, num_to_return), nullptr, &distances, config);
+    vector<pair<float, int>> result(min(ids.size(), static_cast<size_t>(num_to_return)));
+    for (size_t i = 0; i < result.size(); ++i) {
+        result[i] = make_pair(distances[i], static_cast<int>(graph.getOriginalId(ids[i])));
+    }
+    return result;
+}
@@ -0,0 +1,82 @@
+#ifndef ANN_INDEX_H
+#define ANN_INDEX_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include "hnsw.h"
+#include "vamana.h"
+#include "../config.h"
+
+/**
+ * Graph index behind a common interface, so that benchmarks can build and search
+ * HNSW and Vamana the same way. Indexes link the caller's nodes, which must
+ * outlive them. Searches use config->ef_search as the beam width, batches run on
+ * config->num_threads threads, and results are (squared distance, node ID) pairs
+ * from closest to furthest.
+ */
+class AnnIndex {
+public:
+    virtual ~AnnIndex() {}
+    virtual std::string get_name() const = 0;
+
+    // Links every node into the graph
+    virtual void build(Config* config) = 0;
+    // Links a node that is not in the graph yet
+    virtual void add(Config* config, int node) = 0;
+    virtual std::vector<std::pair<float, int>> search(Config* config, float* query, int num_to_return) = 0;
+    virtual std::vector<std::vector<std::pair<float, int>>> batch_search(Config* config, float** queries, int num_queries, int num_to_return) = 0;
+
+    // Exports to config->runs_prefix and imports from config->loaded_graph_file
+    virtual void save(Config* config, const std::string& graph_name) = 0;
+    virtual void load(Config* config) = 0;
+
+    // Search counters summed over every thread since the last reset
+    virtual SearchStatistics get_statistics() const = 0;
+    virtual void reset_statistics() = 0;
+};
+
+// HNSW graph, whose constructor links node 0 as the first entry point
+class HNSWIndex : public AnnIndex {
+public:
+    HNSW* hnsw;
+
+    HNSWIndex(Config* config, float** nodes);
+    ~HNSWIndex();
+    std::string get_name() const { return "hnsw"; }
+    void build(Config* config);
+    void add(Config* config, int node);
+    std::vector<std::pair<float, int>> search(Config* config, float* query, int num_to_return);
+    std::vector<std::vector<std::pair<float, int>>> batch_search(Config* config, float** queries, int num_queries, int num_to_return);
+    void save(Config* config, const std::string& graph_name);
+    void load(Config* config);
+    SearchStatistics get_statistics() const;
+    void reset_statistics();
+};
+
+/**
+ * Vamana graph built with the config->vamana_* parameters. Nodes added before a
+ * build are inserted one at a time, the first becoming the search start point.
+ * Distance computations are counted as layer 0 ones and hops as candidates popped.
+ */
+class VamanaIndex : public AnnIndex {
+public:
+    Graph graph;
+    SearchStatistics statistics;
+
+    VamanaIndex(Config* config, float** nodes);
+    std::string get_name() const { return "vamana"; }
+    void build(Config* config);
+    void add(Config* config, int node);
+    std::vector<std::pair<float, int>> search(Config* config, float* query, int num_to_return);
+    std::vector<std::vector<std::pair<float, int>>> batch_search(Config* config, float** queries, int num_queries, int num_to_return);
+    void save(Config* config, const std::string& graph_name);
+    void load(Config* config);
+    SearchStatistics get_statistics() const { return statistics; }
+    void reset_statistics() { statistics = SearchStatistics(); }
+
+private:
+    std::vector<std::pair<float, int>> search_graph(Config* config, float* query, int num_to_return);
+};
+
+#endif
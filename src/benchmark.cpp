@@ -4,8 +4,10 @@
 #include <unordered_set>
 #include <cpuid.h>
 #include <string.h>
+#include "ann_index.h"
 #include "grasp.h"
 #include "hnsw.h"
+#include "layout.h"
 
 using namespace std;
 
@@ -39,6 +41,182 @@ void get_actual_neighbors(Config* config, vector<vector<int>>& actual_neighbors,
     }
 }
 
+// Graph and layout searched by the query workers on one NUMA node
+struct NodeIndex {
+    HNSW* hnsw;
+    InlineLayout* layout;
+};
+
+// Searches one query using the inline layout if there is one, otherwise the graph
+vector<pair<float, int>> search_index(Config* config, NodeIndex& index, float** queries, int i) {
+    if (index.layout != NULL) {
+        return index.layout->search(config, index.hnsw, queries[i], config->num_return);
+    }
+    vector<Edge*> path;
+    pair<int, float*> query_pair = make_pair(i, queries[i]);
+    return index.hnsw->nn_search(config, path, query_pair, config->num_return);
+}
+
+// Picks a CPU for each query worker, alternating between NUMA nodes so that each node gets its own pool
+vector<int> get_worker_cpus(int num_workers, const vector<vector<int>>& node_cpus) {
+    vector<int> cpus;
+    for (size_t round = 0; cpus.size() < num_workers; ++round) {
+        for (const vector<int>& node : node_cpus) {
+            if (!node.empty() && cpus.size() < num_workers) {
+                cpus.push_back(node[round % node.size()]);
+            }
+        }
+    }
+    return cpus;
+}
+
+// Runs every query on one worker per CPU in cpus, each searching its node's index, and returns queries per second
+double measure_parallel_qps(Config* config, vector<NodeIndex>& node_indexes, const vector<int>& cpus, const vector<int>& cpu_nodes, float** queries) {
+    auto start = chrono::high_resolution_clock::now();
+    node_indexes[0].hnsw->parallel_for(config->num_queries, cpus.size(), cpus, [&](int i, int thread) {
+        search_index(config, node_indexes[cpu_nodes[cpus[thread]]], queries, i);
+    });
+    auto end = chrono::high_resolution_clock::now();
+    return config->num_queries / (chrono::duration_cast<chrono::microseconds>(end - start).count() / 1000000.0);
+}
+
+/**
+ * Builds the graphs and inline layouts searched from each NUMA node: the graph
+ * itself, or with numa_policy 2 a replica per node with workers. Vectors and
+ * records allocated here are put on huge pages if use_huge_pages.
+ */
+vector<NodeIndex> build_node_indexes(Config* config, HNSW* hnsw, const vector<vector<int>>& node_cpus, bool use_huge_pages) {
+    InlineLayout* layout = NULL;
+    vector<NodeIndex> node_indexes(node_cpus.size());
+    for (size_t n = 0; n < node_cpus.size(); ++n) {
+        if (config->numa_policy == 2 && !node_cpus[n].empty()) {
+            ThreadPin pin(node_cpus[n]);
+            node_indexes[n].hnsw = hnsw->replicate(config, n, use_huge_pages);
+            node_indexes[n].layout = config->use_inline_layout ? new InlineLayout(config, node_indexes[n].hnsw, use_huge_pages) : NULL;
+            continue;
+        }
+        if (config->use_inline_layout && layout == NULL) {
+            layout = new InlineLayout(config, hnsw, use_huge_pages);
+        }
+        node_indexes[n] = {hnsw, layout};
+    }
+    if (config->numa_policy == 2) {
+        cout << "Replicated index on " << node_cpus.size() << " NUMA nodes" << endl;
+    }
+    return node_indexes;
+}
+
+// Frees the replicas and layouts made by build_node_indexes, leaving hnsw itself
+void free_node_indexes(HNSW* hnsw, vector<NodeIndex>& node_indexes) {
+    unordered_set<InlineLayout*> layouts;
+    for (NodeIndex& index : node_indexes) {
+        layouts.insert(index.layout);
+        if (index.hnsw != hnsw) {
+            delete index.hnsw;
+        }
+    }
+    for (InlineLayout* layout : layouts) {
+        delete layout;
+    }
+    node_indexes.clear();
+}
+
+/**
+ * Runs every query once the way the benchmark searches them, on worker_cpus if
+ * is_parallel and otherwise serially on the first index, and returns queries per
+ * second. The search statistics are left as they were.
+ */
+double measure_search_qps(Config* config, vector<NodeIndex>& node_indexes, bool is_parallel, const vector<int>& worker_cpus,
+        const vector<int>& cpu_nodes, float** queries) {
+    HNSW* hnsw = node_indexes[0].hnsw;
+    SearchStatistics statistics = hnsw->get_statistics();
+    double qps;
+    if (is_parallel) {
+        qps = measure_parallel_qps(config, node_indexes, worker_cpus, cpu_nodes, queries);
+    } else {
+        auto start = chrono::high_resolution_clock::now();
+        for (int i = 0; i < config->num_queries; ++i) {
+            search_index(config, node_indexes[0], queries, i);
+        }
+        auto end = chrono::high_resolution_clock::now();
+        qps = config->num_queries / (chrono::duration_cast<chrono::microseconds>(end - start).count() / 1000000.0);
+    }
+    hnsw->set_statistics(statistics);
+    return qps;
+}
+
+/**
+ * Builds or loads HNSW and Vamana over the same nodes, then searches both with
+ * the same queries on config->num_threads threads for each ef_search value,
+ * reporting recall, throughput, and distance computations and hops per query.
+ */
+void compare_indexes(Config* config, float** nodes, float** queries, ofstream* results_file) {
+    vector<vector<int>> actual_neighbors;
+    get_actual_neighbors(config, actual_neighbors, nodes, queries);
+    vector<int> ef_search_values = config->benchmark_ef_search.empty() ? vector<int>{config->ef_search} : config->benchmark_ef_search;
+    int default_ef_search = config->ef_search;
+    int num_threads = config->num_threads > 0 ? config->num_threads : omp_get_num_procs();
+    if (results_file != NULL) {
+        *results_file << "\nComparing indexes with " << num_threads << " threads:" << endl;
+        *results_file << "index, ef_search, construction_time, recall, qps, dist_comps/query, hops/query" << endl;
+    }
+
+    vector<AnnIndex*> indexes = {new HNSWIndex(config, nodes), new VamanaIndex(config, nodes)};
+    for (AnnIndex* index : indexes) {
+        // Load the graph if one was given, otherwise build and conditionally save it
+        string default_graph_file = config->loaded_graph_file;
+        if (index->get_name() == "vamana") {
+            config->loaded_graph_file = config->loaded_vamana_graph_file;
+        }
+        double construction_duration = 0;
+        if (config->load_graph_file && config->loaded_graph_file != "") {
+            index->load(config);
+        } else {
+            auto start = chrono::high_resolution_clock::now();
+            index->build(config);
+            auto end = chrono::high_resolution_clock::now();
+            construction_duration = chrono::duration_cast<chrono::milliseconds>(end - start).count() / 1000.0;
+            if (config->export_graph) {
+                index->save(config, index->get_name());
+            }
+        }
+        config->loaded_graph_file = default_graph_file;
+
+        for (int ef_search : ef_search_values) {
+            config->ef_search = ef_search;
+            if (config->ef_search < config->num_return) {
+                cout << "Warning: Skipping ef_search = " << config->ef_search << " which is less than num_return" << endl;
+                continue;
+            }
+            index->reset_statistics();
+            auto start = chrono::high_resolution_clock::now();
+            vector<vector<pair<float, int>>> neighbors = index->batch_search(config, queries, config->num_queries, config->num_return);
+            auto end = chrono::high_resolution_clock::now();
+            double qps = config->num_queries / (chrono::duration_cast<chrono::microseconds>(end - start).count() / 1000000.0);
+            SearchStatistics statistics = index->get_statistics();
+            double dist_comps = static_cast<double>(statistics.layer0_dist_comps + statistics.upper_dist_comps) / config->num_queries;
+            double hops = static_cast<double>(statistics.candidates_popped) / config->num_queries;
+
+            long long similar = 0;
+            for (int j = 0; j < config->num_queries; ++j) {
+                unordered_set<int> actual_set(actual_neighbors[j].begin(), actual_neighbors[j].end());
+                for (const pair<float, int>& n_pair : neighbors[j]) {
+                    similar += actual_set.count(n_pair.second);
+                }
+            }
+            double recall = static_cast<double>(similar) / (config->num_queries * config->num_return);
+            cout << index->get_name() << " with ef_search = " << config->ef_search << ": recall " << recall * 100 << "%, "
+                 << qps << " QPS, " << dist_comps << " distance computations and " << hops << " hops per query" << endl;
+            if (results_file != NULL) {
+                *results_file << index->get_name() << ", " << config->ef_search << ", " << construction_duration << ", "
+                              << recall << ", " << qps << ", " << dist_comps << ", " << hops << endl;
+            }
+        }
+        delete index;
+    }
+    config->ef_search = default_ef_search;
+}
+
 template <typename T>
 void run_benchmark(Config* config, T& parameter, const vector<T>& parameter_values, const string& parameter_name,
         float** nodes, float** queries, float** training, ofstream* results_file) {
@@ -85,7 +263,7 @@ void run_benchmark(Config* config, T& parameter, const vector<T>& parameter_valu
                  << ", ef_search = " << config->ef_search << "\nnum_return = " << config->num_return
                  << ", learning_rate = " << config->learning_rate << ", initial_temperature = " << config->initial_temperature
                  << ", decay_factor = " << config->decay_factor << ", initial_keep_ratio = " << config->initial_keep_ratio
-                 << ", final_keep_ratio = " << config->final_keep_ratio << ", grasp_loops = " << config->grasp_loops  
+                 << ", final_keep_ratio = " << config->final_keep_ratio << ", grasp_loops = " << config->grasp_loops << ", grasp_batch_size = " << config->grasp_batch_size  
                  <<"\nCurrent Run Properties: Stinky Values = "  << std::boolalpha  <<  config->use_stinky_points << " [" <<config->stinky_value <<"]" 
                  << ", use_heuristic = " << config->use_heuristic << ", use_grasp = " << config->use_grasp << ", use_dynamic_sampling = " << config->use_dynamic_sampling 
                  << ", Single search point = " << config->single_ep_construction  << ", current Pruning method = " << config->weight_selection_method  
@@ -95,6 +273,7 @@ void run_benchmark(Config* config, T& parameter, const vector<T>& parameter_valu
             for (int i = 1; i < config->num_nodes; ++i) {
                 hnsw->insert(config, i);
             }
+            hnsw->pair_distances.clear();  // Only used while inserting
 
             // Run GraSP
             if (config->use_grasp) {
@@ -135,6 +314,11 @@ void run_benchmark(Config* config, T& parameter, const vector<T>& parameter_valu
             cout << "Construction time: " << duration / 1000.0 << " seconds, ";
             cout << "Distance computations (layer 0): " << hnsw->layer0_dist_comps << ", ";
             cout << "Distance computations (top layers): " << hnsw->upper_dist_comps << endl;
+            if (config->use_grasp) {
+                long long int num_training_searches = static_cast<long long int>(config->grasp_loops) * config->grasp_subloops * config->num_training;
+                cout << "Distance computations saved by GraSP dual search: " << hnsw->saved_dist_comps << " ("
+                     << static_cast<double>(hnsw->saved_dist_comps) / num_training_searches << " per training query)" << endl;
+            }
             construction_duration = duration / 1000.0;
         }
 
@@ -149,6 +333,45 @@ void run_benchmark(Config* config, T& parameter, const vector<T>& parameter_valu
             candidates_without_if = 0;
             break;
         }
+        // Give each NUMA node a pool of query workers, searching a replica of the index on that node if requested
+        vector<vector<int>> node_cpus = get_numa_node_cpus();
+        vector<int> cpu_nodes;
+        int num_cpus = 0;
+        for (size_t n = 0; n < node_cpus.size(); ++n) {
+            for (int cpu : node_cpus[n]) {
+                cpu_nodes.resize(max(cpu_nodes.size(), static_cast<size_t>(cpu) + 1));
+                cpu_nodes[cpu] = n;
+                ++num_cpus;
+            }
+        }
+        bool is_parallel = config->num_threads != 1 || config->numa_policy == 2;
+        vector<int> worker_cpus = get_worker_cpus(config->num_threads > 0 ? config->num_threads : num_cpus, node_cpus);
+
+        // Build the query-time centroid table and search indexes, first timing the queries before reordering nodes for memory locality
+        double qps_before_reorder = 0;
+        vector<NodeIndex> node_indexes;
+        if (config->reorder_method != 0) {
+            if (config->use_centroid_entry_points) {
+                hnsw->build_centroid_table(config);
+            }
+            node_indexes = build_node_indexes(config, hnsw, node_cpus, config->use_huge_pages);
+            qps_before_reorder = measure_search_qps(config, node_indexes, is_parallel, worker_cpus, cpu_nodes, queries);
+            free_node_indexes(hnsw, node_indexes);
+            hnsw->reorder_nodes(config);
+        }
+        if (config->use_centroid_entry_points) {
+            hnsw->build_centroid_table(config);
+        }
+        if (config->export_inline_layout) {
+            InlineLayout(config, hnsw, config->use_huge_pages).to_file(config, parameter_name + "_" + to_string(parameter_values[i]));
+        }
+        node_indexes = build_node_indexes(config, hnsw, node_cpus, config->use_huge_pages);
+        if (config->reorder_method != 0) {
+            double qps_after_reorder = measure_search_qps(config, node_indexes, is_parallel, worker_cpus, cpu_nodes, queries);
+            cout << "QPS before reordering: " << qps_before_reorder << ", QPS after reordering: " << qps_after_reorder
+                 << " (" << (qps_after_reorder / qps_before_reorder - 1) * 100 << "% change)" << endl;
+        }
+
         hnsw->reset_statistics();
         if (config->print_path_size) {
             hnsw->total_path_size = 0;
@@ -181,27 +404,33 @@ void run_benchmark(Config* config, T& parameter, const vector<T>& parameter_valu
                 counts_calcs.push_back(0);
             }
             auto start = chrono::high_resolution_clock::now();
-            neighbors.reserve(config->num_queries);
-            vector<Edge*> path;
-            vector<long long int> dist_comps_per_q_vec;
-
-            for (int i = 0; i < config->num_queries; ++i) {
+            neighbors.resize(config->num_queries);
+            vector<long long int> dist_comps_per_q_vec(config->num_queries);
+            auto search_query = [&](int i, int thread) {
+                NodeIndex& index = is_parallel ? node_indexes[cpu_nodes[worker_cpus[thread]]] : node_indexes[0];
                 hnsw->cur_groundtruth = actual_neighbors[i];
                 hnsw->layer0_dist_comps_per_q = 0;
-                pair<int, float*> query_pair = make_pair(i, queries[i]);
-                neighbors.emplace_back(hnsw->nn_search(config, path, query_pair, config->num_return));
-                if (config->export_calcs_per_query) {
-                    ++counts_calcs[std::min(19, hnsw->layer0_dist_comps_per_q / config->interval_for_calcs_histogram)];
-                }
-                if (config->export_median_calcs) {
-                    dist_comps_per_q_vec.push_back(hnsw->layer0_dist_comps_per_q);
-                }
-                if (config->print_neighbor_percent) {
-                    for (int i = 0; i < hnsw->percent_neighbors.size(); ++i) {
-                        cout << hnsw->percent_neighbors[i] << " ";
+                neighbors[i] = search_index(config, index, queries, i);
+                dist_comps_per_q_vec[i] = hnsw->layer0_dist_comps_per_q;
+            };
+
+            if (is_parallel) {
+                hnsw->parallel_for(config->num_queries, worker_cpus.size(), worker_cpus, search_query);
+            } else {
+                for (int i = 0; i < config->num_queries; ++i) {
+                    search_query(i, 0);
+                    if (config->print_neighbor_percent) {
+                        for (int i = 0; i < hnsw->percent_neighbors.size(); ++i) {
+                            cout << hnsw->percent_neighbors[i] << " ";
+                        }
+                        cout << endl;
+                        hnsw->percent_neighbors.clear();
                     }
-                    cout << endl;
-                    hnsw->percent_neighbors.clear();
+                }
+            }
+            if (config->export_calcs_per_query) {
+                for (long long int calcs : dist_comps_per_q_vec) {
+                    ++counts_calcs[std::min(19LL, calcs / config->interval_for_calcs_histogram)];
                 }
             }
 
@@ -215,6 +444,27 @@ void run_benchmark(Config* config, T& parameter, const vector<T>& parameter_valu
                 cout << "Average Path Size: " << static_cast<double>(hnsw->total_path_size) / config->num_queries << endl;
                 hnsw->total_path_size = 0;
             }
+            if (config->compare_huge_pages) {
+                // Rerun the queries with the vectors, replicas and layouts copied onto the other page size
+                double qps_current = measure_search_qps(config, node_indexes, is_parallel, worker_cpus, cpu_nodes, queries);
+                float** original_nodes = hnsw->nodes;
+                float* copy_slab = static_cast<float*>(allocate_index_memory(sizeof(float) * config->num_nodes * config->dimensions, !config->use_huge_pages, true));
+                float** copy_nodes = new float*[config->num_nodes];
+                for (int j = 0; j < config->num_nodes; ++j) {
+                    copy_nodes[j] = copy_slab + static_cast<size_t>(j) * config->dimensions;
+                    std::copy(original_nodes[j], original_nodes[j] + config->dimensions, copy_nodes[j]);
+                }
+                hnsw->nodes = copy_nodes;
+                vector<NodeIndex> copy_indexes = build_node_indexes(config, hnsw, node_cpus, !config->use_huge_pages);
+                print_huge_page_report();
+                double qps_other = measure_search_qps(config, copy_indexes, is_parallel, worker_cpus, cpu_nodes, queries);
+                free_node_indexes(hnsw, copy_indexes);
+                hnsw->nodes = original_nodes;
+                free_index_memory(copy_slab);
+                delete[] copy_nodes;
+                cout << "QPS with huge pages: " << (config->use_huge_pages ? qps_current : qps_other)
+                     << ", QPS without huge pages: " << (config->use_huge_pages ? qps_other : qps_current) << endl;
+            }
             if (config->export_median_calcs) {
                 std::sort(dist_comps_per_q_vec.begin(), dist_comps_per_q_vec.end());
                 median_comps_layer0 = dist_comps_per_q_vec[dist_comps_per_q_vec.size() / 2];
@@ -234,6 +484,26 @@ void run_benchmark(Config* config, T& parameter, const vector<T>& parameter_valu
             candidates_size = hnsw->candidates_size;
             candidates_without_if = hnsw->candidates_without_if;
 
+            if (config->benchmark_numa_scaling) {
+                // Rerun the queries with a worker per CPU on each node alone, then on every node together
+                SearchStatistics statistics = hnsw->get_statistics();
+                double single_node_qps = 0;
+                int num_used_nodes = 0;
+                for (size_t n = 0; n < node_cpus.size(); ++n) {
+                    if (node_cpus[n].empty()) {
+                        continue;
+                    }
+                    double qps = measure_parallel_qps(config, node_indexes, node_cpus[n], cpu_nodes, queries);
+                    cout << "QPS on NUMA node " << n << " with " << node_cpus[n].size() << " workers: " << qps << endl;
+                    single_node_qps = single_node_qps == 0 ? qps : single_node_qps;
+                    ++num_used_nodes;
+                }
+                double all_nodes_qps = measure_parallel_qps(config, node_indexes, get_worker_cpus(num_cpus, node_cpus), cpu_nodes, queries);
+                cout << "QPS on all " << num_used_nodes << " NUMA nodes with " << num_cpus << " workers: " << all_nodes_qps
+                     << " (" << all_nodes_qps / single_node_qps << "x the first node)" << endl;
+                hnsw->set_statistics(statistics);
+            }
+
             if (neighbors.empty())
                 break;
 
@@ -321,6 +591,7 @@ void run_benchmark(Config* config, T& parameter, const vector<T>& parameter_valu
             hnsw->to_files(config, parameter_name + "_" + to_string(parameter_values[i]), construction_duration);
         }
 
+        free_node_indexes(hnsw, node_indexes);
         delete hnsw;
     }
     // Write to benchmark file
@@ -350,7 +621,7 @@ void run_benchmarks(Config* config, float** nodes, float** queries, float** trai
                 
                 << "\nnum_return = " << config->num_return << ", learning_rate = " << config->learning_rate << ", initial_temperature = " << config->initial_temperature
                 << ", decay_factor = " << config->decay_factor << ", initial_keep_ratio = " << config->initial_keep_ratio
-                << ", final_keep_ratio = " << config->final_keep_ratio << ", grasp_loops = " << config->grasp_loops  << ", Single training = " << config->single_ep_training 
+                << ", final_keep_ratio = " << config->final_keep_ratio << ", grasp_loops = " << config->grasp_loops << ", grasp_batch_size = " << config->grasp_batch_size  << ", Single training = " << config->single_ep_training 
                 
                 <<"\nCurrent Run Properties: Stinky Values = "  << std::boolalpha  <<  config->use_stinky_points << " [" <<config->stinky_value <<"]" 
                 << ", use_heuristic = " << config->use_heuristic << ", use_grasp = " << config->use_grasp << ", use_dynamic_sampling = " << config->use_dynamic_sampling  << ", use_cost_benefit = " << config->use_cost_benefit 
@@ -386,6 +657,11 @@ void run_benchmarks(Config* config, float** nodes, float** queries, float** trai
     }
 
 
+    // Compare the graph indexes before varying parameters
+    if (config->benchmark_compare_indexes) {
+        compare_indexes(config, nodes, queries, results_file);
+    }
+
     // Run benchmarks
     run_benchmark(config, config->optimal_connections, config->benchmark_optimal_connections,
         "opt_con", nodes, queries, training, results_file);
@@ -419,6 +695,8 @@ void run_benchmarks(Config* config, float** nodes, float** queries, float** trai
             nodes, queries, training, results_file);
         run_benchmark(config, config->grasp_loops, config->benchmark_grasp_loops, "grasp_loops",
             nodes, queries, training, results_file);
+        run_benchmark(config, config->grasp_batch_size, config->benchmark_grasp_batch_size, "grasp_batch_size",
+            nodes, queries, training, results_file);
     }
 }
 
@@ -453,8 +731,12 @@ int main() {
     Config* config = new Config();
 
     // Load nodes
+    apply_numa_policy(config);
     float** nodes = new float*[config->num_nodes];
     load_nodes(config, nodes);
+    if (config->use_huge_pages) {
+        print_huge_page_report();
+    }
     float** queries = new float*[config->num_queries];
     load_queries(config, nodes, queries);
     float** training = nullptr;
@@ -487,9 +769,7 @@ int main() {
     }
 
     // Clean up
-    for (int i = 0; i < config->num_nodes; ++i)
-        delete[] nodes[i];
-    delete[] nodes;
+    free_nodes(nodes);
     for (int i = 0; i < config->num_queries; ++i)
         delete[] queries[i];
     delete[] queries;
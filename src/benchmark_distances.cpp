@@ -0,0 +1,95 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include "utils.h"
+
+using namespace std;
+
+/**
+ * Measures the throughput of the distance kernels on random vectors gathered
+ * from a pool larger than the caches, as search and neighbor selection do. Each
+ * list size is timed with single calls, the batched kernel, and the pairwise
+ * kernel, and the batched results are checked against the single calls.
+ */
+int main() {
+    Config* config = new Config();
+    const int num_vectors = 200000;
+    const int num_lists = 20000;
+    const vector<int> list_sizes = {4, 8, 16, 32, 64};
+
+    // Generate the vector pool
+    mt19937 gen(config->graph_seed);
+    uniform_real_distribution<float> dis(config->gen_min, config->gen_max);
+    vector<float> slab(static_cast<size_t>(num_vectors) * config->dimensions);
+    for (float& value : slab) {
+        value = dis(gen);
+    }
+    vector<float*> pool(num_vectors);
+    for (int i = 0; i < num_vectors; ++i) {
+        pool[i] = slab.data() + static_cast<size_t>(i) * config->dimensions;
+    }
+    uniform_int_distribution<int> pick(0, num_vectors - 1);
+
+    cout << "Dimensions: " << config->dimensions << ", lists per size: " << num_lists << endl;
+    for (int size : list_sizes) {
+        // Gather a query and a list of vectors for each run
+        vector<float*> queries(num_lists);
+        vector<float*> lists(static_cast<size_t>(num_lists) * size);
+        for (int i = 0; i < num_lists; ++i) {
+            queries[i] = pool[pick(gen)];
+            for (int j = 0; j < size; ++j) {
+                lists[static_cast<size_t>(i) * size + j] = pool[pick(gen)];
+            }
+        }
+        vector<float> single_distances(size);
+        vector<float> batch_distances(size);
+        vector<float> pairwise_distances(size * size);
+        double checksum = 0;
+        bool is_matching = true;
+
+        auto start = chrono::high_resolution_clock::now();
+        for (int i = 0; i < num_lists; ++i) {
+            for (int j = 0; j < size; ++j) {
+                single_distances[j] = calculate_l2_sq(queries[i], lists[static_cast<size_t>(i) * size + j], config->dimensions);
+            }
+            checksum += single_distances[size - 1];
+        }
+        auto end = chrono::high_resolution_clock::now();
+        double single_seconds = chrono::duration<double>(end - start).count();
+
+        start = chrono::high_resolution_clock::now();
+        for (int i = 0; i < num_lists; ++i) {
+            calculate_l2_sq_batch(queries[i], &lists[static_cast<size_t>(i) * size], size, config->dimensions, batch_distances.data());
+            checksum += batch_distances[size - 1];
+        }
+        end = chrono::high_resolution_clock::now();
+        double batch_seconds = chrono::duration<double>(end - start).count();
+
+        start = chrono::high_resolution_clock::now();
+        for (int i = 0; i < num_lists; ++i) {
+            calculate_l2_sq_pairwise(&lists[static_cast<size_t>(i) * size], size, config->dimensions, pairwise_distances.data());
+            checksum += pairwise_distances[size - 1];
+        }
+        end = chrono::high_resolution_clock::now();
+        double pairwise_seconds = chrono::duration<double>(end - start).count();
+
+        // Check the last list against single calls
+        for (int j = 0; j < size; ++j) {
+            is_matching = is_matching && single_distances[j] == batch_distances[j];
+            for (int k = j + 1; k < size; ++k) {
+                float* row = lists[static_cast<size_t>(num_lists - 1) * size + j];
+                float* column = lists[static_cast<size_t>(num_lists - 1) * size + k];
+                is_matching = is_matching && pairwise_distances[j * size + k] == calculate_l2_sq(row, column, config->dimensions);
+            }
+        }
+
+        double num_single = static_cast<double>(num_lists) * size;
+        double num_pairs = static_cast<double>(num_lists) * size * (size - 1) / 2;
+        cout << "K = " << size
+             << ": single " << num_single / single_seconds / 1e6 << " M/s"
+             << ", batch " << num_single / batch_seconds / 1e6 << " M/s"
+             << ", pairwise " << num_pairs / pairwise_seconds / 1e6 << " M/s"
+             << (is_matching ? "" : " (MISMATCH)") << " [" << checksum << "]" << endl;
+    }
+}
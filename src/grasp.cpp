@@ -6,10 +6,13 @@
 #include <random>
 #include <cfloat> 
 #include <algorithm>
+#include <parallel/algorithm>
 #include <iomanip>
 #include <unordered_set>
-
-#include "grasp.h"
+#include <immintrin.h>
+#include <chrono>
+#include <map>
+#include <cstring>
 
 using namespace std;
 
@@ -17,19 +20,31 @@ using namespace std;
  * edges with the lowest scores
  **/
 void learn_cost_benefit(Config* config, HNSW* hnsw, vector<Edge*>& edges, float** training, int num_keep) {
-    // Check how beneficial each edge is
-    int total_benefit = 0;
-    int total_cost = 0;
-    int* total_cost_pointer = &total_cost;
-    for (int i = 0; i < config->num_training; i++) {
+    TrainingStore* store = new TrainingStore(config, edges);
+    hnsw->training_store = store;
+    int num_threads = config->num_threads > 0 ? config->num_threads : omp_get_num_procs();
+
+    // Check how beneficial each edge is. Edge counters are incremented atomically,
+    // while the totals are kept per thread and summed afterward
+    vector<long long> thread_benefits(num_threads, 0);
+    vector<long long> thread_costs(num_threads, 0);
+    hnsw->parallel_for(config->num_training, num_threads, {}, [&](int i, int thread) {
         pair<int, float*> query = make_pair(i, training[i]);
         vector<Edge*> path;
+        int query_cost = 0;
         // Search for the query while counting the cost of each edge
-        vector<pair<float, int>> nearest_neighbors = hnsw->nn_search(config, path, query, config->num_return, false, true, false, total_cost_pointer);
+        vector<pair<float, int>> nearest_neighbors = hnsw->nn_search(config, path, query, config->num_return, false, true, false, &query_cost);
         for (int j = 0; j < path.size(); j++) {
-            path[j]->benefit += 1;
-            total_benefit += 1;
+            TrainingStore::increment(store->benefits, path[j]->index);
         }
+        thread_benefits[thread] += path.size();
+        thread_costs[thread] += query_cost;
+    });
+    long long total_benefit = 0;
+    long long total_cost = 0;
+    for (int t = 0; t < num_threads; t++) {
+        total_benefit += thread_benefits[t];
+        total_cost += thread_costs[t];
     }
     
     // Initialize exports
@@ -47,38 +62,30 @@ void learn_cost_benefit(Config* config, HNSW* hnsw, vector<Edge*>& edges, float*
     // Compute average cost and benefit to use as a baseline for score comparisons
     float average_benefit = static_cast<float>(total_benefit) / edges.size();
     float average_cost = static_cast<float>(total_cost) / edges.size();
-    auto compare = [average_benefit, average_cost](Edge* lhs, Edge* rhs) {
-        return (average_benefit + lhs->benefit) / (average_cost + lhs->cost) > (average_benefit + rhs->benefit) / (average_cost + rhs->cost);
-    };
     cout << "Average Benefit: " << average_benefit << " Average Cost: " << average_cost << endl;
+    vector<float> scores(edges.size());
+    #pragma omp parallel for num_threads(num_threads)
+    for (size_t i = 0; i < edges.size(); i++) {
+        scores[i] = (average_benefit + store->benefits[i]) / (average_cost + store->costs[i]);
+    }
+    for (size_t i = 0; i < edges.size(); i++) {
+        counts_cost[std::min(19, store->costs[i] / config->interval_for_cost_histogram)]++;
+        counts_benefit[std::min(19, store->benefits[i] / config->interval_for_benefit_histogram)]++;
+    }
 
-    // Mark edges for deletion
-    priority_queue<Edge*, vector<Edge*>, decltype(compare)> remaining_edges(compare);
-    for (int i = 0; i < edges.size(); i++) {
-        counts_cost[std::min(19, edges[i]->cost / config->interval_for_cost_histogram)]++;
-        counts_benefit[std::min(19, edges[i]->benefit / config->interval_for_benefit_histogram)]++;
-        // Enable edge by default
-        edges[i]->ignore = false;
-        remaining_edges.push(edges[i]);
-        // Disable edge if it is pushed out of remaining edges
-        if (remaining_edges.size() > num_keep) {
-            remaining_edges.top()->ignore = true;
-            remaining_edges.pop();
-        }
-    }
-    // Remove all edges in layer 0 that are marked for deletion
-    for (int i = 0; i < hnsw->num_nodes; i++) {
-        for (int j = hnsw->mappings[i][0].size() - 1; j >= 0; j--) {
-            vector<Edge>& neighbors = hnsw->mappings[i][0];
-            if (neighbors[j].ignore) {
-                if (config->export_cost_benefit_pruned) {
-                    *pruned_file << neighbors[j].target << " " << neighbors[j].cost << " " << neighbors[j].benefit << endl;
+    // Mark all but the num_keep highest scores, logging the marked edges before they are removed
+    mark_lowest_scores(edges, scores, num_keep, num_threads);
+    if (config->export_cost_benefit_pruned) {
+        for (int i = 0; i < hnsw->num_nodes; i++) {
+            for (const Edge& neighbor : hnsw->mappings[i][0]) {
+                if (neighbor.ignore) {
+                    *pruned_file << neighbor.target << " " << store->costs[neighbor.index] << " " << store->benefits[neighbor.index] << endl;
                 }
-                neighbors[j] = neighbors[neighbors.size() - 1];
-                neighbors.pop_back();
             }
         }
     }
+    remove_marked_edges(hnsw, num_threads);
+
     // Write and close exports
     if (config->export_histograms) {
         ofstream cost_histogram = ofstream(config->runs_prefix + "histogram_cost.txt", std::ios::app);
@@ -96,46 +103,288 @@ void learn_cost_benefit(Config* config, HNSW* hnsw, vector<Edge*>& edges, float*
         pruned_file->close();
         delete pruned_file;
     }
+    hnsw->training_store = nullptr;
+    delete store;
+}
+
+TrainingStore::TrainingStore(Config* config, vector<Edge*>& edges) : num_edges(edges.size()), temperature(config->initial_temperature), num_searched(0) {
+    for (size_t i = 0; i < num_edges; i++) {
+        edges[i]->index = i;
+    }
+    if (config->use_grasp) {
+        weights.assign(num_edges, _cvtss_sh(50, _MM_FROUND_TO_NEAREST_INT));
+        probabilities.assign(num_edges, 0);
+        weight_changes.assign(num_edges, 0);
+        num_of_updates.assign(num_edges, 0);
+        for (size_t i = 0; i < num_edges; i++) {
+            set_probability(i, 0.5);
+        }
+    }
+    if (config->use_stinky_points) {
+        stinky.assign(num_edges, 0);
+    }
+    if (config->use_cost_benefit) {
+        costs.assign(num_edges, std::min(config->initial_cost, static_cast<int>(UINT16_MAX)));
+        benefits.assign(num_edges, std::min(config->initial_benefit, static_cast<int>(UINT16_MAX)));
+    }
+}
+
+IncrementalCache::IncrementalCache(Config* config, HNSW* hnsw, float** training) : entries(config->num_training) {
+    for (int i = 0; i < config->num_training; i++) {
+        slots[training[i]] = i;
+    }
+    was_ignored.assign(hnsw->training_store->num_edges, 0);
+    node_changed.assign(hnsw->num_nodes, 0);
+}
+
+// Records the nodes with a bottom-layer edge whose ignore state changed since the last sample
+void IncrementalCache::find_changed_nodes(HNSW* hnsw) {
+    num_samples++;
+    for (int i = 0; i < hnsw->num_nodes; i++) {
+        for (Edge& edge : hnsw->mappings[i][0]) {
+            if (edge.ignore != was_ignored[edge.index]) {
+                was_ignored[edge.index] = edge.ignore;
+                node_changed[i] = num_samples;
+            }
+        }
+    }
+}
+
+/**
+ * Returns whether a cached sampled search may have changed. The search can only
+ * expand nodes it added to its beam, which are its entry points and the targets
+ * of its path edges. Points outside the current mini-batch may have missed
+ * several samples, so each node records the last sample that changed it.
+ */
+bool IncrementalCache::is_sample_stale(const Entry& entry) const {
+    for (const pair<float, int>& entry_point : entry.entry_points) {
+        if (node_changed[entry_point.second] > entry.checked_sample)
+            return true;
+    }
+    for (Edge* edge : entry.sample_path) {
+        if (node_changed[edge->target] > entry.checked_sample)
+            return true;
+    }
+    return false;
+}
+
+// Approximates exp for 8 floats with a degree-5 polynomial after range reduction (relative error around 1e-7)
+static inline __m256 exp_ps(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-88.3762626647949f)), _mm256_set1_ps(88.3762626647949f));
+
+    // Split x into n * ln(2) + r with |r| <= ln(2) / 2
+    __m256 n = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _mm256_set1_ps(0.5f)));
+    x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(0.693359375f)));
+    x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(-2.12194440e-4f)));
+
+    // Evaluate exp(r)
+    __m256 y = _mm256_set1_ps(1.9875691500E-4f);
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.3981999507E-3f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(8.3334519073E-3f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(4.1665795894E-2f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.6666665459E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(5.0000001201E-1f));
+    y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y, _mm256_mul_ps(x, x)), x), _mm256_set1_ps(1.0f));
+
+    // Build 2^n in the exponent bits, shifting each 128-bit half since AVX has no 256-bit integer shifts
+    __m256i exponent = _mm256_cvttps_epi32(n);
+    __m128i low = _mm_slli_epi32(_mm_add_epi32(_mm256_castsi256_si128(exponent), _mm_set1_epi32(127)), 23);
+    __m128i high = _mm_slli_epi32(_mm_add_epi32(_mm256_extractf128_si256(exponent, 1), _mm_set1_epi32(127)), 23);
+    __m256 power = _mm256_castsi256_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(low), high, 1));
+    return _mm256_mul_ps(y, power);
+}
+
+// Computes 1 / (1 + exp(-(weight + mu) / temperature)) for 8 weights
+static inline __m256 sigmoid_ps(__m256 weight, __m256 mu, __m256 inverse_temperature) {
+    __m256 x = _mm256_mul_ps(_mm256_add_ps(weight, mu), inverse_temperature);
+    __m256 one = _mm256_set1_ps(1.0f);
+    return _mm256_div_ps(one, _mm256_add_ps(one, exp_ps(_mm256_sub_ps(_mm256_setzero_ps(), x))));
+}
+
+// Returns the bucket of a weight in the 20-bucket weight histogram
+static inline int weight_bucket(float weight, int interval) {
+    if (weight < 0) {
+        return 0;
+    }
+    return weight >= 19 * interval ? 19 : weight / interval + 1;
+}
+
+/**
+ * Adds mu to every weight and sets each probability to the sigmoid of the new
+ * weight at the given temperature, in one pass over 8 edges at a time. If
+ * weight_counts is set, the new weights are also counted into its 20 buckets.
+ */
+void TrainingStore::shift_weights(float mu, float temperature, int* weight_counts, int interval) {
+    this->temperature = temperature;
+    size_t parts = num_edges / 8;
+    __m256 mu_vec = _mm256_set1_ps(mu);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 inverse_temperature = _mm256_set1_ps(1 / temperature);
+    __m256 scale = _mm256_set1_ps(255);
+    __m256 half = _mm256_set1_ps(0.5f);
+    float new_weights[8];
+    for (size_t i = 0; i < parts; i++) {
+        __m128i* address = reinterpret_cast<__m128i*>(&weights[i * 8]);
+        __m256 weight = _mm256_add_ps(_mm256_cvtph_ps(_mm_loadu_si128(address)), mu_vec);
+        __m128i weight_ph = _mm256_cvtps_ph(weight, _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(address, weight_ph);
+
+        // Probabilities use the stored fp16 weights, then are scaled to [0, 255] and packed into bytes
+        weight = _mm256_cvtph_ps(weight_ph);
+        __m256 probability = _mm256_add_ps(_mm256_mul_ps(sigmoid_ps(weight, zero, inverse_temperature), scale), half);
+        __m256i quantized = _mm256_cvttps_epi32(probability);
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(quantized), _mm256_extractf128_si256(quantized, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(&probabilities[i * 8]), _mm_packus_epi16(words, words));
+
+        if (weight_counts != nullptr) {
+            _mm256_storeu_ps(new_weights, weight);
+            for (int j = 0; j < 8; j++) {
+                weight_counts[weight_bucket(new_weights[j], interval)]++;
+            }
+        }
+    }
+    for (size_t i = parts * 8; i < num_edges; i++) {
+        set_weight(i, get_weight(i) + mu);
+        set_probability(i, 1 / (1 + exp(-get_weight(i) / temperature)));
+        if (weight_counts != nullptr) {
+            weight_counts[weight_bucket(get_weight(i), interval)]++;
+        }
+    }
+}
+
+/**
+ * Returns the maximum (at least 0) and minimum weights. If probability_counts is
+ * set, the current probabilities are also counted into its 20 buckets in the
+ * same pass.
+ */
+pair<float, float> TrainingStore::find_max_min(int* probability_counts) const {
+    size_t parts = num_edges / 8;
+    __m256 max_vec = _mm256_setzero_ps();
+    __m256 min_vec = _mm256_set1_ps(FLT_MAX);
+    for (size_t i = 0; i < parts; i++) {
+        __m256 weight = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&weights[i * 8])));
+        max_vec = _mm256_max_ps(max_vec, weight);
+        min_vec = _mm256_min_ps(min_vec, weight);
+        if (probability_counts != nullptr) {
+            for (size_t j = i * 8; j < i * 8 + 8; j++) {
+                probability_counts[probabilities[j] == 255 ? 19 : probabilities[j] * 20 / 255]++;
+            }
+        }
+    }
+    float max_parts[8];
+    float min_parts[8];
+    _mm256_storeu_ps(max_parts, max_vec);
+    _mm256_storeu_ps(min_parts, min_vec);
+    float max_w = *std::max_element(max_parts, max_parts + 8);
+    float min_w = *std::min_element(min_parts, min_parts + 8);
+    for (size_t i = parts * 8; i < num_edges; i++) {
+        max_w = std::max(max_w, get_weight(i));
+        min_w = std::min(min_w, get_weight(i));
+        if (probability_counts != nullptr) {
+            probability_counts[probabilities[i] == 255 ? 19 : probabilities[i] * 20 / 255]++;
+        }
+    }
+    return make_pair(max_w, min_w);
+}
+
+/**
+ * Sums the probabilities every edge would have after adding mu to its weight.
+ * If derivative is set, it receives the derivative of the sum with respect to mu.
+ */
+double TrainingStore::sum_probabilities(float mu, float temperature, double* derivative) const {
+    size_t parts = num_edges / 8;
+    __m256 mu_vec = _mm256_set1_ps(mu);
+    __m256 inverse_temperature = _mm256_set1_ps(1 / temperature);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256d sum_vec = _mm256_setzero_pd();
+    __m256d slope_vec = _mm256_setzero_pd();
+    for (size_t i = 0; i < parts; i++) {
+        __m256 weight = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&weights[i * 8])));
+        __m256 probability = sigmoid_ps(weight, mu_vec, inverse_temperature);
+        __m256 slope = _mm256_mul_ps(probability, _mm256_sub_ps(one, probability));
+
+        // Accumulate in double so the sum over millions of edges stays exact to well under one edge
+        sum_vec = _mm256_add_pd(sum_vec, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(probability)), _mm256_cvtps_pd(_mm256_extractf128_ps(probability, 1))));
+        slope_vec = _mm256_add_pd(slope_vec, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(slope)), _mm256_cvtps_pd(_mm256_extractf128_ps(slope, 1))));
+    }
+    double sum_parts[4];
+    double slope_parts[4];
+    _mm256_storeu_pd(sum_parts, sum_vec);
+    _mm256_storeu_pd(slope_parts, slope_vec);
+    double sum = sum_parts[0] + sum_parts[1] + sum_parts[2] + sum_parts[3];
+    double slope = slope_parts[0] + slope_parts[1] + slope_parts[2] + slope_parts[3];
+    for (size_t i = parts * 8; i < num_edges; i++) {
+        double probability = 1 / (1 + exp(-(get_weight(i) + mu) / temperature));
+        sum += probability;
+        slope += probability * (1 - probability);
+    }
+    if (derivative != nullptr) {
+        *derivative = slope / temperature;
+    }
+    return sum;
 }
 
 /**
  * Alg 1
  * Given an HNSW, a list of its weighted edges, and a list of training nodes,
  * learn the importance of the HNSW's edges and increase their weights accordingly.
- * Note: This will shuffle the training set.
+ * Note: This will shuffle the training set. The training state stays in
+ * hnsw->training_store until prune_edges consumes it.
  */
 void learn_edge_importance(Config* config, HNSW* hnsw, vector<Edge*>& edges, float** training, ofstream* results_file) {
     // Initialize parameters
+    hnsw->training_store = new TrainingStore(config, edges);
     float temperature = config->initial_temperature;
     float lambda = 0;
     mt19937 gen(config->shuffle_seed);
     if (results_file != nullptr) {
-        *results_file << "iteration\t# of Weights updated\t# of Edges updated\n"; 
+        *results_file << "iteration\t# of Weights updated\t# of Edges updated" << (config->use_incremental_grasp ? "\t% Recomputed" : "") << "\n";
+    }
+    TrainingGenerator* generator = nullptr;
+    TrainingGenerator* stream = nullptr;
+    if (config->generate_our_training && config->regenerate_each_iteration) {
+        generator = new TrainingGenerator(config, hnsw, hnsw->nodes, training, config->num_training);
+    }
+    // Regenerated points are only searched once, so there is nothing to reuse
+    IncrementalCache* cache = nullptr;
+    if (config->use_incremental_grasp && generator == nullptr) {
+        cache = new IncrementalCache(config, hnsw, training);
     }
 
-    // Run the training loop
+    // Run the training loop, splitting each pass over the shuffled training set into mini-batches
+    int batch_size = config->grasp_batch_size > 0 ? min(config->grasp_batch_size, config->num_training) : config->num_training;
+    bool is_mini_batch = batch_size < config->num_training;
     for (int k = 0; k < config->grasp_loops; k++) {
         for (int j = 0; j < config->grasp_subloops; j++) {
             lambda = compute_lambda(config->final_keep_ratio, config->initial_keep_ratio, k, config->grasp_loops, config->keep_exponent);
-            if (j == config->grasp_subloops - 1) {
-                normalize_weights(config, hnsw, edges, lambda, temperature);
-            }
-            if (!config->use_dynamic_sampling) {
-                sample_subgraph(config, edges, lambda);
-            }
-            if (results_file != nullptr) {
-                *results_file << k;
+            for (int batch_start = 0; batch_start < config->num_training; batch_start += batch_size) {
+                // Each mini-batch is searched on a subgraph sampled from the weights left by the previous one
+                if (j == config->grasp_subloops - 1 || is_mini_batch) {
+                    normalize_weights(config, hnsw, edges, lambda, temperature);
+                }
+                if (!config->use_dynamic_sampling) {
+                    sample_subgraph(config, edges, hnsw->training_store, lambda);
+                }
+                if (cache != nullptr) {
+                    cache->find_changed_nodes(hnsw);
+                }
+                if (results_file != nullptr) {
+                    *results_file << k;
+                }
+                int num_batch = min(batch_size, config->num_training - batch_start);
+                update_weights(config, hnsw, training + batch_start, num_batch, config->num_return, results_file, stream, cache);
             }
-            update_weights(config, hnsw, training, config->num_return, results_file);
 
             temperature = config->initial_temperature * pow(config->decay_factor, k);
             std::shuffle(training, training + config->num_training, gen);
         }
-        // Generate a new set of training sets each iteration
+        // Generate a new set of training points on the fly in each later iteration
         if(config->generate_our_training && config->regenerate_each_iteration){
-            load_training(config, hnsw->nodes, training, config->num_training);
+            stream = generator;
         }
     }
+    delete generator;
+    delete cache;
 }
 
 /**
@@ -144,37 +393,30 @@ void learn_edge_importance(Config* config, HNSW* hnsw, vector<Edge*>& edges, flo
  * which is computed from the weight range, lambda, and temperature
  */
 void normalize_weights(Config* config, HNSW* hnsw, vector<Edge*>& edges, float lambda, float temperature) {
-    // Compute normalizing factor mu
-    float target = lambda * edges.size();
-    pair<float,float> max_min = find_max_min(config, hnsw);
-    float avg_w = temperature * log(lambda / (1 - lambda));
-    float search_range_min = avg_w - max_min.first;
-    float search_range_max = avg_w - max_min.second;
-    float mu = binary_search(config, edges, search_range_min, search_range_max, target, temperature);
-    
+    TrainingStore* store = hnsw->training_store;
+
     // Initialize edge distribution vectors
     int* counts_prob = new int[20];
     int* counts_w = new int [20];
     std::fill(counts_prob, counts_prob + 20, 0);
     std::fill(counts_w, counts_w + 20, 0);
-  
-    // Normalize edge weights and probabilities
-    for(int i = 0; i < config->num_nodes ; i++){
-        for(int k = 0; k < hnsw->mappings[i][0].size(); k++){
-            Edge& edge = hnsw->mappings[i][0][k];
-            int count_position = edge.probability_edge >= 1 ? 19 : edge.probability_edge * 20;
-            edge.weight += mu;
-            edge.probability_edge = 1 / (1 + exp(-edge.weight / temperature));
-            counts_prob[count_position]++;
-            // Update edge distributions
-            if(edge.weight < 0) {
-                counts_w[0]++;
-            } else {
-                count_position = edge.weight >=19*config->interval_for_weight_histogram ? 19: edge.weight/config->interval_for_weight_histogram +1; 
-                counts_w[count_position]++;
-            }
-        }
+
+    // Compute normalizing factor mu, recording the previous probability distribution in the same pass as the weight range
+    auto start = chrono::high_resolution_clock::now();
+    float target = lambda * edges.size();
+    pair<float,float> max_min = find_max_min(config, hnsw, counts_prob);
+    float avg_w = temperature * log(lambda / (1 - lambda));
+    float search_range_min = avg_w - max_min.first;
+    float search_range_max = avg_w - max_min.second;
+    float mu = find_normalizing_factor(config, store, search_range_min, search_range_max, target, temperature);
+
+    // Normalize edge weights and probabilities while updating the weight distribution
+    store->shift_weights(mu, temperature, counts_w, config->interval_for_weight_histogram);
+    if (config->print_weight_updates) {
+        auto end = chrono::high_resolution_clock::now();
+        cout << "Normalized " << store->num_edges << " weights in " << chrono::duration_cast<chrono::microseconds>(end - start).count() / 1000.0 << " ms" << endl;
     }
+
     // Record distributions in histogram text files
     if (config->export_histograms) {
         ofstream histogram = ofstream(config->runs_prefix + "histogram_prob.txt", std::ios::app);
@@ -200,94 +442,237 @@ void normalize_weights(Config* config, HNSW* hnsw, vector<Edge*>& edges, float l
  * edges and remove the rest of its edges.
  */
 void prune_edges(Config* config, HNSW* hnsw, vector<Edge*>& edges, int num_keep) {
-    // Lower edge probabilities by stinky points
-    if(config->use_stinky_points){
-        for (auto e: edges){
-            e->probability_edge -= config->stinky_value * e->stinky;
-        }
-    }
-    // Mark lowest weight edges for deletion
-    auto compare =[](Edge* lhs, Edge* rhs) { return lhs->probability_edge > rhs->probability_edge;};
-    priority_queue<Edge*, vector<Edge*>, decltype(compare)> remaining_edges(compare);
-    for (int i = 0; i < edges.size(); i++) {
-        // Enable edge by default
-        edges[i]->ignore = false;
-        remaining_edges.push(edges[i]);
-        // Disable edge if it is pushed out of remaining edges
-        if (remaining_edges.size() > num_keep) {
-            remaining_edges.top()->ignore = true;
-            remaining_edges.pop();
-        }
-    }
-    // Remove all edges in layer 0 that are marked for deletion
-    for (int i = 0; i < hnsw->num_nodes; i++) {
-        for (int j = hnsw->mappings[i][0].size() - 1; j >= 0; j--) {
-            vector<Edge>& neighbors = hnsw->mappings[i][0];
-            if (neighbors[j].ignore) {
-                neighbors[j] = neighbors[neighbors.size() - 1];
-                neighbors.pop_back();
+    // Lower edge probabilities by stinky points, using full-precision probabilities to rank edges
+    TrainingStore* store = hnsw->training_store;
+    int num_threads = config->num_threads > 0 ? config->num_threads : omp_get_num_procs();
+    vector<float> scores(edges.size());
+    #pragma omp parallel for num_threads(num_threads)
+    for (size_t i = 0; i < edges.size(); i++) {
+        scores[i] = 1 / (1 + exp(-store->get_weight(i) / store->temperature));
+        if (config->use_stinky_points) {
+            scores[i] -= config->stinky_value * config->stinky_value * store->stinky[i];
+        }
+    }
+    mark_lowest_scores(edges, scores, num_keep, num_threads);
+    remove_marked_edges(hnsw, num_threads);
+    hnsw->training_store = nullptr;
+    delete store;
+}
+
+/**
+ * Marks every edge as ignored except the num_keep with the highest scores. The
+ * threshold is found by a parallel selection that breaks ties by edge index, so
+ * the kept edges do not depend on the number of threads.
+ */
+void mark_lowest_scores(vector<Edge*>& edges, const vector<float>& scores, int num_keep, int num_threads) {
+    vector<int> ranked(edges.size());
+    for (size_t i = 0; i < edges.size(); i++) {
+        ranked[i] = i;
+    }
+    if (num_keep < edges.size()) {
+        auto compare = [&scores](int lhs, int rhs) { return scores[lhs] > scores[rhs] || (scores[lhs] == scores[rhs] && lhs < rhs); };
+        __gnu_parallel::nth_element(ranked.begin(), ranked.begin() + max(num_keep, 0), ranked.end(), compare);
+    }
+    #pragma omp parallel for num_threads(num_threads)
+    for (size_t i = 0; i < ranked.size(); i++) {
+        edges[ranked[i]]->ignore = i >= num_keep;
+    }
+}
+
+// Counts the bottom-layer nodes reachable from the entry point, optionally without ignored edges
+static int count_reachable(HNSW* hnsw, bool skip_ignored) {
+    vector<char> is_reached(hnsw->num_nodes, false);
+    vector<int> frontier = {hnsw->entry_point};
+    is_reached[hnsw->entry_point] = true;
+    int num_reached = 1;
+    while (!frontier.empty()) {
+        int node = frontier.back();
+        frontier.pop_back();
+        for (const Edge& edge : hnsw->mappings[node][0]) {
+            if ((!skip_ignored || !edge.ignore) && !is_reached[edge.target]) {
+                is_reached[edge.target] = true;
+                frontier.push_back(edge.target);
+                num_reached++;
             }
         }
     }
+    return num_reached;
+}
+
+/**
+ * Removes the ignored edges from the bottom layer. Each adjacency list is compacted
+ * in place, so the kept neighbors stay in the distance order set by insert. Prints
+ * the resulting degree distribution and the nodes that can no longer be reached
+ * from the entry point within the bottom layer.
+ */
+void remove_marked_edges(HNSW* hnsw, int num_threads) {
+    int unreachable_before = hnsw->num_nodes - count_reachable(hnsw, false);
+    int unreachable_after = hnsw->num_nodes - count_reachable(hnsw, true);
+    #pragma omp parallel for schedule(dynamic, 1024) num_threads(num_threads)
+    for (int i = 0; i < hnsw->num_nodes; i++) {
+        vector<Edge>& neighbors = hnsw->mappings[i][0];
+        neighbors.erase(std::remove_if(neighbors.begin(), neighbors.end(), [](const Edge& edge) { return edge.ignore; }), neighbors.end());
+    }
+
+    // Summarize the pruned graph
+    size_t max_degree = 0;
+    long long num_kept = 0;
+    for (int i = 0; i < hnsw->num_nodes; i++) {
+        max_degree = max(max_degree, hnsw->mappings[i][0].size());
+        num_kept += hnsw->mappings[i][0].size();
+    }
+    vector<int> degree_counts(max_degree + 1, 0);
+    for (int i = 0; i < hnsw->num_nodes; i++) {
+        degree_counts[hnsw->mappings[i][0].size()]++;
+    }
+    cout << "Pruned to " << num_kept << " edges, average degree " << static_cast<double>(num_kept) / hnsw->num_nodes << ", degree counts:";
+    for (size_t degree = 0; degree <= max_degree; degree++) {
+        if (degree_counts[degree] > 0) {
+            cout << " " << degree << ":" << degree_counts[degree];
+        }
+    }
+    cout << endl;
+    cout << "Nodes unreachable from the entry point: " << unreachable_after << " (" << unreachable_after - unreachable_before << " from pruning)" << endl;
 }
 
 /**
  * Compare the nearest neighbors and paths taken on the sampled graph with
- * the original graph, and increase edge weights accordingly
+ * the original graph, and increase edge weights accordingly. Training queries
+ * are searched in parallel in fixed-size blocks. Each block logs its weight
+ * changes, and the logs are added in query order, so the result does not
+ * depend on the number of threads. If a generator is given, each pass searches
+ * newly generated points instead of the training array. If a cache is given,
+ * searches whose results cannot have changed since the last pass are reused.
  */
-void update_weights(Config* config, HNSW* hnsw, float** training, int num_neighbors, ofstream* results_file) {
+void update_weights(Config* config, HNSW* hnsw, float** training, int num_training, int num_neighbors, ofstream* results_file, TrainingGenerator* generator, IncrementalCache* cache) {
+    TrainingStore* store = hnsw->training_store;
+    int num_threads = config->num_threads > 0 ? config->num_threads : omp_get_num_procs();
+    const int block_size = 64;
+    const int blocks_per_round = 256;
+    vector<vector<pair<int, float>>> block_changes(blocks_per_round);
+    vector<int> block_updates(blocks_per_round);
+    vector<int> block_edges_updated(blocks_per_round);
+    vector<int> block_recomputed(blocks_per_round);
+    vector<size_t> changed_edges;
+    changed_edges.swap(store->pending_edges);
     int num_updates = 0;
     int num_of_edges_updated = 0;
-    for (int i = 0; i < config->num_training; i++) {
-        int similar_nodes = 0;
+    int num_recomputed = 0;
+    SearchStatistics statistics_before = hnsw->get_statistics();
 
-        // Find the nearest neighbor and paths taken using the original and sampled graphs
-        pair<int, float*> query = make_pair(i, training[i]);
-        vector<Edge*> sample_path;
-        vector<Edge*> original_path;
-        vector<pair<float, int>> sample_nearest = hnsw->nn_search(config, sample_path, query, num_neighbors, false, true, true);
-        vector<pair<float, int>> original_nearest = hnsw->nn_search(config, original_path, query, num_neighbors, false, true, false);
-        unordered_set<Edge*> sample_path_set(sample_path.begin(), sample_path.end());
-        double weight_change = calculate_weight_change(config, original_nearest, sample_nearest, results_file);
-
-        // Add stinky points to each path edge
-        if(config->use_stinky_points) {
-            for (int j = 0; j < sample_path.size(); j++) 
-                sample_path[j]->stinky += config->stinky_value;
-            for (int j = 0; j < original_path.size(); j++)
-                original_path[j]->stinky += config->stinky_value;
-        }
-
-        // Update edge weights if the change is non-zero
-        if(weight_change != 0) {
-            for (int j = 0; j < original_path.size(); j++) {
-                // Select edges according to config->weight_selection_method
-                if ((config->weight_selection_method == 0) ||
-                    (config->weight_selection_method == 1 && original_path[j]->ignore) ||
-                    (config->weight_selection_method == 2 && sample_path_set.find(original_path[j]) == sample_path_set.end())
-                ) {
-                    original_path[j]->weight += weight_change;
-                    original_path[j]->num_of_updates++;
-                    num_of_edges_updated++;
+    auto update_block = [&](int round_start, int block) {
+        block_changes[block].clear();
+        block_updates[block] = 0;
+        block_edges_updated[block] = 0;
+        block_recomputed[block] = 0;
+        int end = min(num_training, round_start + (block + 1) * block_size);
+        vector<float> generated(generator != nullptr ? config->dimensions : 0);
+        for (int i = round_start + block * block_size; i < end; i++) {
+            long long pass_index = store->num_searched + i;
+            if (config->use_dynamic_sampling) {
+                hnsw->sampling_gen.seed(config->sample_seed + pass_index);
+            }
+            if (generator != nullptr) {
+                generator->generate_point(config, pass_index, generated.data());
+            }
+
+            // Find the nearest neighbor and paths taken using the original and sampled graphs
+            pair<int, float*> query = make_pair(i, generator != nullptr ? generated.data() : training[i]);
+            IncrementalCache::Entry scratch;
+            IncrementalCache::Entry& searches = cache != nullptr ? cache->entries[cache->slots.at(training[i])] : scratch;
+            vector<Edge*>& sample_path = searches.sample_path;
+            vector<Edge*>& original_path = searches.original_path;
+            vector<pair<float, int>>& sample_nearest = searches.sample_nearest;
+            vector<pair<float, int>>& original_nearest = searches.original_nearest;
+            if (cache == nullptr || !searches.is_searched) {
+                hnsw->dual_search(config, query, num_neighbors, sample_path, original_path, sample_nearest, original_nearest, &searches.entry_points);
+                searches.is_searched = true;
+                block_recomputed[block]++;
+            } else if (cache->is_sample_stale(searches)) {
+                hnsw->search_bottom_layer(config, query.second, searches.entry_points, num_neighbors, sample_path, sample_nearest, true);
+                block_recomputed[block]++;
+            }
+            if (cache != nullptr) {
+                searches.checked_sample = cache->num_samples;
+            }
+            unordered_set<Edge*> sample_path_set(sample_path.begin(), sample_path.end());
+            double weight_change = calculate_weight_change(config, original_nearest, sample_nearest, nullptr);
+            if (config->export_negative_values && results_file != nullptr && weight_change < 0 && config->weight_formula == 0) {
+                #pragma omp critical
+                *results_file << "weight is being updated by a negative value" << endl;
+            }
+
+            // Add stinky points to each path edge
+            if(config->use_stinky_points) {
+                for (int j = 0; j < sample_path.size(); j++) 
+                    store->add_stinky(sample_path[j]->index, 1);
+                for (int j = 0; j < original_path.size(); j++)
+                    store->add_stinky(original_path[j]->index, 1);
+            }
+
+            // Log edge weight changes if the change is non-zero
+            if(weight_change != 0) {
+                for (int j = 0; j < original_path.size(); j++) {
+                    // Select edges according to config->weight_selection_method
+                    if ((config->weight_selection_method == 0) ||
+                        (config->weight_selection_method == 1 && original_path[j]->ignore) ||
+                        (config->weight_selection_method == 2 && sample_path_set.find(original_path[j]) == sample_path_set.end())
+                    ) {
+                        int index = original_path[j]->index;
+                        block_changes[block].emplace_back(index, weight_change);
+                        TrainingStore::increment(store->num_of_updates, index);
+                        block_edges_updated[block]++;
+                    }
                 }
+                block_updates[block]++;
+            }
+        }
+    };
+
+    // Search a round of blocks in parallel, then add their changes in order
+    for (int round_start = 0; round_start < num_training; round_start += block_size * blocks_per_round) {
+        int num_blocks = min(blocks_per_round, (num_training - round_start + block_size - 1) / block_size);
+        hnsw->parallel_for(num_blocks, num_threads, {}, [&](int block, int thread) {
+            update_block(round_start, block);
+        });
+        for (int block = 0; block < num_blocks; block++) {
+            for (const pair<int, float>& change : block_changes[block]) {
+                if (store->weight_changes[change.first] == 0)
+                    changed_edges.push_back(change.first);
+                store->weight_changes[change.first] += change.second;
             }
-            num_updates++;
+            num_updates += block_updates[block];
+            num_of_edges_updated += block_edges_updated[block];
+            num_recomputed += block_recomputed[block];
         }
     }
+    // Apply the summed changes to the touched edges only, so small batches do not sweep every edge.
+    // Whatever fp16 cannot represent is kept for the next call instead of being rounded away
+    sort(changed_edges.begin(), changed_edges.end());
+    changed_edges.erase(unique(changed_edges.begin(), changed_edges.end()), changed_edges.end());
+    for (size_t j : changed_edges) {
+        if (store->weight_changes[j] != 0) {
+            float target = store->get_weight(j) + store->weight_changes[j];
+            store->set_weight(j, target);
+            store->weight_changes[j] = target - store->get_weight(j);
+            if (store->weight_changes[j] != 0) {
+                store->pending_edges.push_back(j);
+            }
+        }
+    }
+    store->num_searched += num_training;
 
     // Create a histogram of the frequency of edge updates
     if(config->export_histograms){
         int* count_updates = new int [20];
         std::fill(count_updates, count_updates + 20, 0);
-        for (int j = 0; j < config->num_nodes ; j++){
-            for (int k = 0; k < hnsw->mappings[j][0].size(); k++){
-                Edge& edge = hnsw->mappings[j][0][k];
-                if (edge.num_of_updates == 0 ) {
-                    count_updates[0]++;
-                } else {
-                    int count_position = edge.num_of_updates > 18*config->interval_for_num_of_updates_histogram ? 19 : edge.num_of_updates/config->interval_for_num_of_updates_histogram+1;
-                    count_updates[count_position]++;
-                }
+        for (size_t j = 0; j < store->num_edges; j++) {
+            int num_of_updates = store->num_of_updates[j];
+            if (num_of_updates == 0) {
+                count_updates[0]++;
+            } else {
+                int count_position = num_of_updates > 18*config->interval_for_num_of_updates_histogram ? 19 : num_of_updates/config->interval_for_num_of_updates_histogram+1;
+                count_updates[count_position]++;
             }
         }
 
@@ -300,10 +685,24 @@ void update_weights(Config* config, HNSW* hnsw, float** training, int num_neighb
         delete[] count_updates;
     }
     if (config->print_weight_updates) {
-        cout << "# of Weight Updates: " << num_updates << " / " << config->num_training << ", # of Edges Updated: " << num_of_edges_updated << endl; 
+        cout << "# of Weight Updates: " << num_updates << " / " << num_training << ", # of Edges Updated: " << num_of_edges_updated << endl; 
+        // Report the distance computations dual_search avoided compared to two separate searches
+        SearchStatistics statistics = hnsw->get_statistics();
+        double computed = statistics.layer0_dist_comps + statistics.upper_dist_comps - statistics_before.layer0_dist_comps - statistics_before.upper_dist_comps;
+        double saved = statistics.saved_dist_comps - statistics_before.saved_dist_comps;
+        cout << "Distance computations per training query: " << computed / num_training << ", saved by dual search: "
+             << saved / num_training << " (" << 100 * saved / (computed + saved) << "%)" << endl;
+        if (cache != nullptr) {
+            cout << "Recomputed searches: " << num_recomputed << " / " << num_training << " ("
+                 << 100.0 * num_recomputed / num_training << "%)" << endl;
+        }
     }
     if (config->export_weight_updates && results_file != nullptr) {
-        *results_file << "\t\t\t" <<num_updates << "\t\t\t\t" << num_of_edges_updated  <<endl; 
+        *results_file << "\t\t\t" <<num_updates << "\t\t\t\t" << num_of_edges_updated;
+        if (cache != nullptr) {
+            *results_file << "\t\t\t" << 100.0 * num_recomputed / num_training;
+        }
+        *results_file << endl;
     }
     
 }
@@ -359,20 +758,19 @@ double calculate_weight_change(Config* config, vector<pair<float, int>>& origina
 /**
  * Randomly disable edges in the provided list of edges
  */
-void sample_subgraph(Config* config, vector<Edge*>& edges, float lambda) {
+void sample_subgraph(Config* config, vector<Edge*>& edges, TrainingStore* store, float lambda) {
     //mark any edge less than a randomly created probability as ignored, thus creating a subgraph with less edges 
     //Note: the number is not necessarily lambda * E 
     mt19937 gen(config->sample_seed);
     normal_distribution<float> dis(0, lambda);
     int count = 0;
-    for(Edge* edge : edges) {
-        if (dis(gen) < (1 - edge->probability_edge)) {
-            edge->ignore = true;
+    for (size_t i = 0; i < edges.size(); i++) {
+        if (dis(gen) < (1 - store->get_probability(i))) {
+            edges[i]->ignore = true;
             count++;
         } else {
-            edge->ignore = false; 
+            edges[i]->ignore = false; 
         }
-        
     }
 }
 
@@ -381,53 +779,40 @@ float compute_lambda(float final_keep, float initial_keep, int k, int num_iterat
     return final_keep + (initial_keep - final_keep) * pow(1 - static_cast<float>(k) / num_iterations, c);
 }
  
-// Find the maximum and minimum weights in the HNSW
-pair<float,float> find_max_min(Config* config, HNSW* hnsw) {
-    float max_w = 0.0f; 
-    float min_w = FLT_MAX; 
-    float lowest_percentage = 1.0f;
-    float max_probability = 0.0f;
-    pair<float,float> max_min;
-    for(int i = 0; i < config->num_nodes ; i++){
-        for(int k = 0; k < hnsw->mappings[i][0].size(); k++){
-            if(max_w < hnsw->mappings[i][0][k].weight)
-                max_w = hnsw->mappings[i][0][k].weight;
-            
-            if(min_w > hnsw->mappings[i][0][k].weight)
-                min_w = hnsw->mappings[i][0][k].weight;
-        }
-    }
+// Find the maximum and minimum weights in the HNSW, optionally counting the probability distribution
+pair<float,float> find_max_min(Config* config, HNSW* hnsw, int* probability_counts) {
+    pair<float,float> max_min = hnsw->training_store->find_max_min(probability_counts);
+    float max_w = max_min.first;
+    float min_w = max_min.second;
     if (config->print_weight_updates) {
         cout << "Min W :" << min_w <<  " Max W is: " <<  max_w << endl;
     }
-    max_min = make_pair(max_w, min_w);
     return max_min;
 }
 
 /**
- * Binary search for the mu value (mid) that makes the sum of probabilities
- * equal lambda * E.
+ * Finds the mu value that makes the sum of probabilities equal lambda * E. The
+ * sum is increasing in mu, so Newton steps are taken from the middle of the
+ * range, falling back to bisection whenever a step leaves the bracketing range.
  */
-float binary_search(Config* config, vector<Edge*>& edges, float left, float right, float target, float temperature) {
-    float sum_of_probabilities = 0;
+float find_normalizing_factor(Config* config, TrainingStore* store, float left, float right, float target, float temperature) {
+    float mu = left + (right - left) / 2;
     int count = 0;
-    // Stops when the difference between endpoints is less than the specified precision
-    // or when the number of iterations reaches the specified limit
+    // Stops when the sum is within one edge of the target, when the range is
+    // narrower than the specified precision, or when the iteration limit is reached
     while ((right - left > 1e-3) && count < 1000) {
         count++;
-        float mid = left + (right - left) / 2;
-        for (const Edge* edge : edges) {
-            sum_of_probabilities += 1/(1 + exp(-(edge->weight + mid) / temperature));
-        }
-        if(abs(sum_of_probabilities - target) < 1.0f)
-            break;
-        else if (sum_of_probabilities < target) 
-            left = mid; 
-         else 
-            right = mid; 
-        sum_of_probabilities = 0;
+        double derivative = 0;
+        double sum_of_probabilities = store->sum_probabilities(mu, temperature, &derivative);
+        if (abs(sum_of_probabilities - target) < 1.0f)
+            return mu;
+        else if (sum_of_probabilities < target)
+            left = mu;
+        else
+            right = mu;
+        float newton = derivative > 0 ? mu - (sum_of_probabilities - target) / derivative : left;
+        mu = newton > left && newton < right ? newton : left + (right - left) / 2;
     }
-
     return left + (right - left) / 2;
 }
 
@@ -514,26 +899,138 @@ void load_training(Config* config, float** nodes, float** training, int num_trai
 
 }
 
-// Remove training points that are also found in the other array
+TrainingGenerator::TrainingGenerator(Config* config, HNSW* hnsw, float** nodes, float** sources, int num_sources)
+    : hnsw(hnsw), nodes(nodes), sources(sources), num_sources(num_sources), seed(config->training_seed), num_neighbors(100) {}
+
+// Writes the mix of a random source point and two of its nearest neighbors into point
+void TrainingGenerator::generate_point(Config* config, long long index, float* point) {
+    seed_seq seeds = {seed, static_cast<int>(index & 0x7fffffff), static_cast<int>(index >> 31)};
+    mt19937 gen(seeds);
+    uniform_real_distribution<float> dis(0, 0.9999999);
+
+    // Choose a random node out of the source dataset
+    int index_first = dis(gen) * num_sources;
+    pair<int, float*> query = make_pair(index_first, sources[index_first]);
+
+    // Choose 2 random nearest neighbors out of the closest num_neighbors
+    vector<Edge*> path;
+    vector<pair<float, int>> nearest_neighbors = hnsw->nn_search(config, path, query, num_neighbors, true);
+    int index_second = nearest_neighbors[static_cast<int>(dis(gen) * nearest_neighbors.size())].second;
+    int index_third = nearest_neighbors[static_cast<int>(dis(gen) * nearest_neighbors.size())].second;
+
+    // Choose a random coefficient for each node
+    float u = dis(gen);
+    float v = dis(gen);
+    float w = dis(gen);
+
+    // Normalize coefficients such that they add up to 1
+    float total = u + v + w;
+    u /= total;
+    v /= total;
+    w /= total;
+
+    // Generate a node in the middle of the 3 selected nodes
+    for (int j = 0; j < config->dimensions; j++) {
+        point[j] = u * sources[index_first][j] + v * nodes[index_second][j] + w * nodes[index_third][j];
+    }
+}
+
+/**
+ * Generates num_generated points on config->num_threads threads and appends them
+ * to an fvecs file one chunk at a time, so only one chunk is held in memory.
+ */
+void TrainingGenerator::generate_to_file(Config* config, const string& file, long long num_generated) {
+    ofstream f(file, ios::binary | ios::out);
+    if (!f) {
+        cout << "Unable to open file " << file << " for writing!" << endl;
+        exit(-1);
+    }
+    cout << "Saving " << num_generated << " generated vectors to file " << file << endl;
+    int num_threads = config->num_threads > 0 ? config->num_threads : omp_get_num_procs();
+    const int chunk_size = 16384;
+    int dim = config->dimensions;
+    vector<float> chunk(static_cast<size_t>(chunk_size) * dim);
+    for (long long start = 0; start < num_generated; start += chunk_size) {
+        int count = min(static_cast<long long>(chunk_size), num_generated - start);
+        hnsw->parallel_for(count, num_threads, {}, [&](int i, int thread) {
+            generate_point(config, start + i, &chunk[static_cast<size_t>(i) * dim]);
+        });
+        for (int i = 0; i < count; i++) {
+            f.write(reinterpret_cast<const char*>(&dim), 4);
+            f.write(reinterpret_cast<const char*>(&chunk[static_cast<size_t>(i) * dim]), dim * 4);
+        }
+    }
+    f.close();
+}
+
+// Hashes the bits of a vector, treating -0 like 0 so that hashes agree whenever the floats compare equal
+static uint64_t hash_vector(const float* vector, int dimensions) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int d = 0; d < dimensions; d++) {
+        uint32_t bits;
+        memcpy(&bits, &vector[d], sizeof(bits));
+        hash = (hash ^ (bits == 0x80000000u ? 0 : bits)) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Remove training points that are also found in the other array. Each vector is
+ * hashed, and training points are only compared exactly against other vectors
+ * with the same hash. When both arrays were loaded from files, the positions of
+ * the duplicates are remembered so loading the same files again skips the search.
+ */
 void remove_duplicates(Config* config, float** training, float** other, int other_num) {
-    int num_training_filtered = config->num_training;
-    for (int i = config->num_training - 1; i >= 0; i--) {
+    // Training file positions of the duplicates, and how many training points were checked
+    static map<string, pair<int, vector<int>>> cached_duplicates;
+    string cache_key = config->training_file + "|" + config->query_file + "|" + to_string(other_num) + "|" + to_string(config->dimensions);
+    bool is_cacheable = config->training_file != "" && config->query_file != "" && !config->generate_our_training;
+    auto cached = cached_duplicates.find(cache_key);
+
+    vector<char> is_duplicate(config->num_training, false);
+    if (is_cacheable && cached != cached_duplicates.end() && cached->second.first >= config->num_training) {
+        for (int i : cached->second.second) {
+            if (i < config->num_training)
+                is_duplicate[i] = true;
+        }
+    } else {
+        // Sort the other vectors by hash, then look up each training point
+        vector<pair<uint64_t, int>> other_hashes(other_num);
+        #pragma omp parallel for
         for (int j = 0; j < other_num; j++) {
-            bool is_same = true;
-            for (int d = 0; d < config->dimensions; d++) {
-                if (training[i][d] != other[j][d]) {
-                    is_same = false;
-                    break;
-                }
+            other_hashes[j] = make_pair(hash_vector(other[j], config->dimensions), j);
+        }
+        sort(other_hashes.begin(), other_hashes.end());
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (int i = 0; i < config->num_training; i++) {
+            uint64_t hash = hash_vector(training[i], config->dimensions);
+            auto match = lower_bound(other_hashes.begin(), other_hashes.end(), make_pair(hash, 0));
+            for (; match != other_hashes.end() && match->first == hash && !is_duplicate[i]; ++match) {
+                is_duplicate[i] = equal(training[i], training[i] + config->dimensions, other[match->second]);
             }
-            if (is_same) {
-                delete[] training[i];
-                training[i] = training[num_training_filtered - 1];
-                training[num_training_filtered - 1] = nullptr;
-                num_training_filtered--;
-                break;
+        }
+        if (is_cacheable) {
+            vector<int> positions;
+            for (int i = 0; i < config->num_training; i++) {
+                if (is_duplicate[i])
+                    positions.push_back(i);
             }
+            cached_duplicates[cache_key] = make_pair(config->num_training, positions);
         }
     }
+
+    // Swap duplicates with the last remaining training point
+    int num_training_filtered = config->num_training;
+    for (int i = config->num_training - 1; i >= 0; i--) {
+        if (is_duplicate[i]) {
+            delete[] training[i];
+            training[i] = training[num_training_filtered - 1];
+            training[num_training_filtered - 1] = nullptr;
+            num_training_filtered--;
+        }
+    }
+    if (num_training_filtered != config->num_training) {
+        cout << "Removed " << config->num_training - num_training_filtered << " training points that are also queries" << endl;
+    }
     config->num_training = num_training_filtered;
 }
@@ -1,8 +1,57 @@
 #ifndef GRASP_H
 #define GRASP_H
 
+#include <unordered_map>
 #include "hnsw.h"
 
+/**
+ * Synthesizes training points by mixing a random source point with two of its
+ * nearest neighbors in the graph. Point i always comes from its own RNG stream
+ * seeded by (seed, i), so the output does not depend on the number of threads.
+ */
+class TrainingGenerator {
+public:
+    HNSW* hnsw;
+    float** nodes;  // Graph vectors in their original order
+    float** sources;
+    int num_sources;
+    int seed;
+    int num_neighbors;  // Size of the neighbor pool the two mixed neighbors are drawn from
+
+    TrainingGenerator(Config* config, HNSW* hnsw, float** nodes, float** sources, int num_sources);
+    void generate_point(Config* config, long long index, float* point);
+    void generate_to_file(Config* config, const std::string& file, long long num_generated);
+};
+
+/**
+ * Searches of each training point kept between GraSP passes. The original graph
+ * does not change while training, so its search runs once per point. A sampled
+ * search only reads the ignore state of edges leaving the nodes it reached, so it
+ * is reused until one of those edges flips.
+ */
+class IncrementalCache {
+public:
+    struct Entry {
+        bool is_searched = false;
+        int checked_sample = 0;  // Last sample the cached sampled search is known to match
+        bool is_sample_valid = false;
+        std::vector<std::pair<float, int>> entry_points;  // Bottom-layer entry points from the upper-layer descent
+        std::vector<Edge*> original_path;
+        std::vector<Edge*> sample_path;
+        std::vector<std::pair<float, int>> original_nearest;
+        std::vector<std::pair<float, int>> sample_nearest;
+    };
+    std::unordered_map<const float*, int> slots;  // Training point to its entry, unchanged by shuffling
+    std::vector<Entry> entries;
+    std::vector<uint8_t> was_ignored;  // Ignore state of each bottom-layer edge at the last sample
+    std::vector<int> node_changed;  // Last sample in which an edge leaving the node flipped
+    int num_samples = 0;
+
+    IncrementalCache(Config* config, HNSW* hnsw, float** training);
+    void find_changed_nodes(HNSW* hnsw);
+    bool is_sample_stale(const Entry& entry) const;
+};
+
 // Main algorithms
 void learn_edge_importance(Config* config, HNSW* hnsw, std::vector<Edge*>& edges, float** queries, std::ofstream* results_file = nullptr);
 void learn_cost_benefit(Config* config, HNSW* hnsw, std::vector<Edge*>& edges, float** training, int num_keep);
@@ -11,11 +60,14 @@ void normalize_weights(Config* config, HNSW* hnsw, std::vector<Edge*>& edges, fl
 // Helper functions
 double calculate_weight_change(Config* config, std::vector<std::pair<float, int>>& original_nearest, std::vector<std::pair<float, int>>& sample_nearest, std::ofstream* results_file);
 void prune_edges(Config* config, HNSW* hnsw, std::vector<Edge*>& edges, int num_keep);
-void sample_subgraph(Config* config, std::vector<Edge*>& edges, float lambda);
-void update_weights(Config* config, HNSW* hnsw, float** training, int num_neighbors, std::ofstream* results_file);
+void mark_lowest_scores(std::vector<Edge*>& edges, const std::vector<float>& scores, int num_keep, int num_threads);
+void remove_marked_edges(HNSW* hnsw, int num_threads);
+void sample_subgraph(Config* config, std::vector<Edge*>& edges, TrainingStore* store, float lambda);
+void update_weights(Config* config, HNSW* hnsw, float** training, int num_training, int num_neighbors, std::ofstream* results_file, TrainingGenerator* generator = nullptr,
+                    IncrementalCache* cache = nullptr);
 float compute_lambda(float final_keep, float initial_keep, int k, int num_iterations, int c);
-std::pair<float,float> find_max_min(Config* config, HNSW* hnsw);
-float binary_search(Config* config, std::vector<Edge*>& edges, float left, float right, float target, float temperature);
+std::pair<float,float> find_max_min(Config* config, HNSW* hnsw, int* probability_counts = nullptr);
+float find_normalizing_factor(Config* config, TrainingStore* store, float left, float right, float target, float temperature);
 void load_training(Config* config, float** nodes, float** training, int num_training, bool is_generating = false);
 void remove_duplicates(Config* config, float** training, float** other, int other_num);
 
@@ -4,30 +4,68 @@
 #include <algorithm>
 #include <unordered_set>
 #include <float.h>
-#include <set>
 #include <limits>
 #include "hnsw.h"
 
 using namespace std;
 
-ofstream* debug_file = NULL;
+// Opened by the thread searching the query being debugged or exported, so other threads never write to them
+thread_local ofstream* debug_file = NULL;
+thread_local ofstream* when_neigh_found_file = NULL;
 
-int correct_nn_found = 0;
-ofstream* when_neigh_found_file;
+Edge::Edge() : target(-1), distance(-1), index(-1), ignore(false) {}
 
-Edge::Edge() : target(-1), distance(-1), weight(50), ignore(false), probability_edge(0.5), num_of_updates(0), stinky(0), benefit(0), cost(0), prev_edge(nullptr){}
+Edge::Edge(int target, float distance) : target(target), distance(distance), index(-1), ignore(false) {}
 
-Edge::Edge(int target, float distance, int initial_cost, int initial_benefit) : target(target), distance(distance),
-    weight(50), ignore(false), probability_edge(0.5), num_of_updates(0), stinky(0), benefit(initial_cost), cost(initial_benefit), prev_edge(nullptr){}
-
-HNSW::HNSW(Config* config, float** nodes) : nodes(nodes), num_layers(1), num_nodes(config->num_nodes),
+HNSW::HNSW(Config* config, float** nodes) : nodes(nodes), training_store(nullptr), node_slab(nullptr), num_layers(1), num_nodes(config->num_nodes),
            num_dimensions(config->dimensions), entry_point(0), normal_factor(1 / -log(config->scaling_factor)),
-           gen(config->insertion_seed), dis(0.0000001, 0.9999999), total_path_size(0), layer0_dist_comps_per_q(0), candidates_without_if(0),candidates_size(0) {
+           gen(config->insertion_seed), dis(0.0000001, 0.9999999) {
     reset_statistics();
+    layer0_dist_comps_per_q = 0;
+    total_path_size = 0;
     mappings.resize(num_nodes);
     mappings[0].resize(1);
 }
 
+HNSW::~HNSW() {
+    if (node_slab != nullptr) {
+        free_index_memory(node_slab);
+        delete[] nodes;
+    }
+}
+
+thread_local int HNSW::layer0_dist_comps_per_q = 0;
+thread_local long long int HNSW::layer0_dist_comps = 0;
+thread_local long long int HNSW::upper_dist_comps = 0;
+thread_local long long int HNSW::processed_neighbors = 0;
+thread_local long long int HNSW::total_neighbors = 0;
+thread_local long long int HNSW::num_distance_termination = 0;
+thread_local long long int HNSW::num_original_termination = 0;
+thread_local long long int HNSW::total_path_size = 0;
+thread_local long long int HNSW::candidates_popped = 0;
+thread_local long long int HNSW::candidates_size = 0;
+thread_local long long int HNSW::candidates_without_if = 0;
+thread_local long long int HNSW::saved_dist_comps = 0;
+thread_local long long int HNSW::correct_nn_found = 0;
+thread_local vector<float> HNSW::percent_neighbors;
+thread_local vector<int> HNSW::cur_groundtruth;
+thread_local mt19937 HNSW::sampling_gen;
+
+void SearchStatistics::add(const SearchStatistics& other) {
+    layer0_dist_comps += other.layer0_dist_comps;
+    upper_dist_comps += other.upper_dist_comps;
+    processed_neighbors += other.processed_neighbors;
+    total_neighbors += other.total_neighbors;
+    num_distance_termination += other.num_distance_termination;
+    num_original_termination += other.num_original_termination;
+    total_path_size += other.total_path_size;
+    candidates_popped += other.candidates_popped;
+    candidates_size += other.candidates_size;
+    candidates_without_if += other.candidates_without_if;
+    saved_dist_comps += other.saved_dist_comps;
+    correct_nn_found += other.correct_nn_found;
+}
+
 void HNSW::reset_statistics() {
     layer0_dist_comps = 0;
     upper_dist_comps = 0;
@@ -38,9 +76,43 @@ void HNSW::reset_statistics() {
     candidates_popped = 0;
     candidates_size = 0 ;
     candidates_without_if = 0;
+    saved_dist_comps = 0;
+    correct_nn_found = 0;
     percent_neighbors.clear();
 }
 
+SearchStatistics HNSW::get_statistics() const {
+    SearchStatistics statistics;
+    statistics.layer0_dist_comps = layer0_dist_comps;
+    statistics.upper_dist_comps = upper_dist_comps;
+    statistics.processed_neighbors = processed_neighbors;
+    statistics.total_neighbors = total_neighbors;
+    statistics.num_distance_termination = num_distance_termination;
+    statistics.num_original_termination = num_original_termination;
+    statistics.total_path_size = total_path_size;
+    statistics.candidates_popped = candidates_popped;
+    statistics.candidates_size = candidates_size;
+    statistics.candidates_without_if = candidates_without_if;
+    statistics.saved_dist_comps = saved_dist_comps;
+    statistics.correct_nn_found = correct_nn_found;
+    return statistics;
+}
+
+void HNSW::set_statistics(const SearchStatistics& statistics) {
+    layer0_dist_comps = statistics.layer0_dist_comps;
+    upper_dist_comps = statistics.upper_dist_comps;
+    processed_neighbors = statistics.processed_neighbors;
+    total_neighbors = statistics.total_neighbors;
+    num_distance_termination = statistics.num_distance_termination;
+    num_original_termination = statistics.num_original_termination;
+    total_path_size = statistics.total_path_size;
+    candidates_popped = statistics.candidates_popped;
+    candidates_size = statistics.candidates_size;
+    candidates_without_if = statistics.candidates_without_if;
+    saved_dist_comps = statistics.saved_dist_comps;
+    correct_nn_found = statistics.correct_nn_found;
+}
+
 /**
  * Alg 1
  * INSERT(hnsw, q, M, Mmax, efConstruction, mL)
@@ -51,6 +123,9 @@ void HNSW::insert(Config* config, int query) {
     vector<Edge*> path;
     entry_points.reserve(config->ef_construction);
     int top = num_layers - 1;
+    if (config->use_heuristic && pair_distances.empty()) {
+        pair_distances.reset(min(static_cast<size_t>(num_nodes) * 16, static_cast<size_t>(1) << 22));
+    }
 
     // Get node layer
     int node_layer = -log(dis(gen)) * normal_factor;
@@ -95,7 +170,7 @@ void HNSW::insert(Config* config, int query) {
         if (config->use_heuristic) {
             vector<Edge> candidates(entry_points.size());
             for (int i = 0; i < entry_points.size(); i++) {
-                candidates[i] = Edge(entry_points[i].second, entry_points[i].first, config->initial_cost, config->initial_benefit);
+                candidates[i] = Edge(entry_points[i].second, entry_points[i].first);
             }
             select_neighbors_heuristic(config, nodes[query], candidates, num_neighbors, layer);
             for (int i = 0; i < num_neighbors; i++) {
@@ -103,7 +178,7 @@ void HNSW::insert(Config* config, int query) {
             }
         } else {
             for (int i = 0; i < min(config->optimal_connections, (int)entry_points.size()); i++) {
-                neighbors[i] = Edge(entry_points[i].second, entry_points[i].first, config->initial_cost, config->initial_benefit);
+                neighbors[i] = Edge(entry_points[i].second, entry_points[i].first);
             }
         }
 
@@ -119,8 +194,7 @@ void HNSW::insert(Config* config, int query) {
         for (auto n_pair : neighbors) {
             vector<Edge>& neighbor_mapping = mappings[n_pair.target][layer];
             // Place query in the correct position in neighbor_mapping
-            float new_dist = calculate_distance(nodes[query], nodes[n_pair.target], num_dimensions, layer);
-            auto new_edge = Edge(query, new_dist, config->initial_cost, config->initial_benefit);
+            auto new_edge = Edge(query, n_pair.distance);
             auto pos = lower_bound(neighbor_mapping.begin(), neighbor_mapping.end(), new_edge,
                 [](const Edge& lhs, const Edge& rhs) { return lhs.distance < rhs.distance || (lhs.distance == rhs.distance && lhs.target < rhs.target); });
             neighbor_mapping.insert(pos, new_edge);
@@ -131,7 +205,7 @@ void HNSW::insert(Config* config, int query) {
             vector<Edge>& neighbor_mapping = mappings[n_pair.target][layer];
             if (neighbor_mapping.size() > max_connections) {
                 if (config->use_heuristic) {
-                    select_neighbors_heuristic(config, nodes[query], neighbor_mapping, max_connections, layer);
+                    select_neighbors_heuristic(config, nodes[n_pair.target], neighbor_mapping, max_connections, layer, false, true, true);
                 } else {
                     neighbor_mapping.pop_back();
                 }
@@ -155,18 +229,22 @@ void HNSW::insert(Config* config, int query) {
  *       , and the path taken is saved into path which can be the direct path or beam_search bath dependent on variable config->use_direct_path
  *         
 */
-void HNSW::search_layer(Config* config, float* query, vector<Edge*>& path, vector<pair<float, int>>& entry_points, int num_to_return, int layer_num, bool is_querying, bool is_training, bool is_ignoring, int* total_cost) {
+void HNSW::search_layer(Config* config, float* query, vector<Edge*>& path, vector<pair<float, int>>& entry_points, int num_to_return, int layer_num, bool is_querying, bool is_training, bool is_ignoring, int* total_cost, DistanceCache* cache) {
     // Initialize search structures
-    auto compare = [](Edge* lhs, Edge* rhs) { return lhs->distance > rhs->distance || (lhs->distance == rhs->distance && lhs->target > rhs->target); };
     unordered_set<int> visited;
-    // The two candidates will be mapped such that if node x is at top of candidates queue, then edge pointing to x will be at the top of candidates_edges 
-    // This way when we explore node x's neighbors and want to add parent edge to those newly explored edges, we use candidates_edges to access node x's edge and assign it as parent edge. 
     priority_queue<pair<float, int>, vector<pair<float, int>>, greater<pair<float, int>>> candidates;
-    priority_queue<Edge*, vector<Edge*>, decltype(compare)> candidates_edges(compare);
-    vector<Edge*> entry_point_edges;
     priority_queue<pair<float, int>> found;
     priority_queue<pair<float, int>> top_k;
     pair<float, int> top_1;
+    uniform_real_distribution<double> sample_dis(dis.param());
+
+    // Record the node and edge each reached node was found from, so that the direct path can be traced back.
+    // Only nodes reached by this search are read, so stale entries from earlier searches are not cleared.
+    static thread_local vector<pair<int, Edge*>> parents;
+    bool is_tracing = layer_num == 0 && is_training && config->use_direct_path;
+    if (is_tracing && parents.size() < num_nodes) {
+        parents.resize(num_nodes);
+    }
 
     // Initialize search_layer statistics
     vector<int> when_neigh_found(config->num_return, -1);
@@ -191,12 +269,8 @@ void HNSW::search_layer(Config* config, float* query, vector<Edge*>& path, vecto
         visited.insert(entry.second);
         candidates.emplace(entry);
         found.emplace(entry);
-        // Create an new edge pointing at entry point
-        if (layer_num == 0 && is_training && config->use_direct_path){
-            Edge* new_Edge = new Edge(entry.second, entry.first, config->initial_cost, config->initial_benefit);
-            candidates_edges.emplace(new_Edge);
-            entry_point_edges.push_back(new_Edge);
-            path.push_back(new_Edge);
+        if (is_tracing) {
+            parents[entry.second] = make_pair(-1, nullptr);
         }
         if (is_querying && layer_num == 0 && (config->use_hybrid_termination || config->use_distance_termination)) {
             top_k.emplace(entry);
@@ -204,7 +278,7 @@ void HNSW::search_layer(Config* config, float* query, vector<Edge*>& path, vecto
         }
         // Check if entry point is in groundtruth and update statistics accordingly
         if ((config->use_groundtruth_termination || config->export_oracle) && is_querying && layer_num == 0) {
-            auto loc = find(cur_groundtruth.begin(), cur_groundtruth.end(), entry.second);
+            auto loc = find(cur_groundtruth.begin(), cur_groundtruth.end(), get_original_id(entry.second));
             if (loc != cur_groundtruth.end()) {
                 int index = distance(cur_groundtruth.begin(), loc);
                 if(index >= 0 && index < when_neigh_found.capacity())
@@ -212,13 +286,21 @@ void HNSW::search_layer(Config* config, float* query, vector<Edge*>& path, vecto
                 ++nn_found;
                 ++correct_nn_found;
                 // Break early if all actual nearest neighbors are found
-                if (config->use_groundtruth_termination && nn_found == config->num_return)
+                if (config->use_groundtruth_termination && nn_found == config->num_return) {
                     candidates = priority_queue<pair<float, int>, vector<pair<float, int>>, greater<pair<float, int>>>();
                     break;
+                }
             }
         }
     }
     
+    // Neighbors reached from the closest candidate, and the ones whose distances still need computing
+    bool is_tracking_groundtruth = (config->use_groundtruth_termination || config->export_oracle) && is_querying && layer_num == 0;
+    vector<pair<float, Edge*>> reached;
+    vector<int> uncached;
+    vector<float*> uncached_vectors;
+    vector<float> uncached_distances;
+
     int candidates_popped_per_q = 0;
     int iteration = 0;
     while (!candidates.empty()) {
@@ -251,11 +333,6 @@ void HNSW::search_layer(Config* config, float* query, vector<Edge*>& path, vecto
         int closest = candidates.top().second;
         float close_dist = candidates.top().first;
         candidates.pop();
-        Edge* closest_edge;
-        if (layer_num == 0 && is_training && config->use_direct_path) {
-            closest_edge = candidates_edges.top();
-            candidates_edges.pop();
-        }
 
         if (layer_num == 0) {
             ++candidates_popped;
@@ -273,18 +350,28 @@ void HNSW::search_layer(Config* config, float* query, vector<Edge*>& path, vecto
             break;
         }
 
-        // Explore neighbors of closest discovered element in the layer
+        // Explore neighbors of closest discovered element in the layer. Newly reached neighbors are gathered
+        // first so that their distances can be computed with one batched call, then added in the original order.
+        // Groundtruth statistics stop at the first nearest neighbor found, so they take one neighbor at a time.
         vector<Edge>& neighbors = mappings[closest][layer_num];
-        for (auto& neighbor_edge : neighbors) {
-            int neighbor = neighbor_edge.target;
-            if (config->print_neighbor_percent && layer_num == 0) {
-                ++total_neighbors;
-            }
-            candidates_without_if++;
-            // Traverse newly discovered neighbor if we don't ignore it
-            bool should_ignore = config->use_dynamic_sampling ? (dis(gen) < (1 -neighbor_edge.probability_edge)) : neighbor_edge.ignore;
-            if (!(is_training && is_ignoring && should_ignore) && visited.find(neighbor) == visited.end()) {
-                visited.insert(neighbor);
+        size_t batch_limit = is_tracking_groundtruth ? 1 : neighbors.size();
+        bool is_stopped = false;
+        for (size_t next = 0; next < neighbors.size() && !is_stopped; ) {
+            reached.clear();
+            uncached.clear();
+            uncached_vectors.clear();
+            for (; next < neighbors.size() && reached.size() < batch_limit; ++next) {
+                Edge& neighbor_edge = neighbors[next];
+                int neighbor = neighbor_edge.target;
+                if (config->print_neighbor_percent && layer_num == 0) {
+                    ++total_neighbors;
+                }
+                candidates_without_if++;
+                // Traverse newly discovered neighbor if we don't ignore it
+                bool should_ignore = is_training && is_ignoring && (config->use_dynamic_sampling ? (sample_dis(sampling_gen) < (1 - training_store->get_probability(neighbor_edge.index))) : neighbor_edge.ignore);
+                if (should_ignore || !visited.insert(neighbor).second) {
+                    continue;
+                }
                 if (config->print_neighbor_percent && layer_num == 0) {
                     ++processed_neighbors;
                     if (total_neighbors == config->interval_for_neighbor_percent) {
@@ -296,17 +383,40 @@ void HNSW::search_layer(Config* config, float* query, vector<Edge*>& path, vecto
 
                 // Add cost point to neighbor's edge if we are training
                 if (is_training && config->use_stinky_points)
-                    neighbor_edge.stinky -= config->stinky_value;
+                    training_store->add_stinky(neighbor_edge.index, -1);
                 if (is_training && config->use_cost_benefit) {
-                    neighbor_edge.cost += 1;
+                    TrainingStore::increment(training_store->costs, neighbor_edge.index);
                     if (total_cost != nullptr) {
                         *total_cost += 1;
                     }
                 }
-                
+
+                float neighbor_dist = 0;
+                if (cache != nullptr && cache->find(neighbor, neighbor_dist)) {
+                    ++saved_dist_comps;
+                } else {
+                    uncached.push_back(reached.size());
+                    uncached_vectors.push_back(nodes[neighbor]);
+                }
+                reached.emplace_back(neighbor_dist, &neighbor_edge);
+            }
+
+            // Compute the distances of the reached neighbors missing from the cache
+            uncached_distances.resize(uncached.size());
+            calculate_distances(query, uncached_vectors.data(), uncached.size(), layer_num, uncached_distances.data());
+            for (size_t i = 0; i < uncached.size(); ++i) {
+                reached[uncached[i]].first = uncached_distances[i];
+                if (cache != nullptr)
+                    cache->insert(reached[uncached[i]].second->target, uncached_distances[i]);
+            }
+
+            for (auto& reached_pair : reached) {
+                float neighbor_dist = reached_pair.first;
+                Edge& neighbor_edge = *reached_pair.second;
+                int neighbor = neighbor_edge.target;
+
                 // Add neighbor to structures if its distance to query is less than furthest found distance or beam structure isn't full
                 float far_inner_dist = found.top().first;
-                float neighbor_dist = calculate_distance(query, nodes[neighbor], num_dimensions, layer_num);
                 if (neighbor_dist < far_inner_dist || found.size() < num_to_return) {
                     candidates.emplace(neighbor_dist, neighbor);
                     found.emplace(neighbor_dist, neighbor);
@@ -322,24 +432,24 @@ void HNSW::search_layer(Config* config, float* query, vector<Edge*>& path, vecto
                     if (layer_num == 0) {
                         path.push_back(&neighbor_edge);
                     }
-                    if (layer_num == 0 && is_training && config->use_direct_path) {
-                        neighbor_edge.distance = neighbor_dist;
-                        neighbor_edge.prev_edge = closest_edge;
-                        candidates_edges.emplace(&neighbor_edge);
+                    if (is_tracing) {
+                        parents[neighbor] = make_pair(closest, &neighbor_edge);
                     }
 
                     // Check if entry point is in groundtruth and update statistics accordingly
-                    if ((config->use_groundtruth_termination || config->export_oracle) && is_querying && layer_num == 0) {
-                        auto loc = find(cur_groundtruth.begin(), cur_groundtruth.end(), neighbor);
+                    if (is_tracking_groundtruth) {
+                        auto loc = find(cur_groundtruth.begin(), cur_groundtruth.end(), get_original_id(neighbor));
                         if (loc != cur_groundtruth.end()) {
                             int index = distance(cur_groundtruth.begin(), loc);
                             when_neigh_found[index] = layer0_dist_comps_per_q;
                             ++nn_found;
                             ++correct_nn_found;
                             // Break early if all actual nearest neighbors are found
-                            if (config->use_groundtruth_termination && nn_found == config->num_return)
+                            if (config->use_groundtruth_termination && nn_found == config->num_return) {
                                 candidates = priority_queue<pair<float, int>, vector<pair<float, int>>, greater<pair<float, int>>>();
+                                is_stopped = true;
                                 break;
+                            }
                         }
                     }
 
@@ -362,11 +472,8 @@ void HNSW::search_layer(Config* config, float* query, vector<Edge*>& path, vecto
         found.pop();
     }
     // Calculate direct path
-    if (config->use_direct_path && layer_num == 0 && is_training) {
-        find_direct_path(path, entry_points);
-        for (Edge* edge : entry_point_edges) {
-            delete edge;
-        }
+    if (is_tracing) {
+        find_direct_path(path, entry_points, parents);
     }
     // Export when_neigh_found data
     if (config->export_oracle && is_querying && layer_num == 0 && when_neigh_found_file != nullptr) {
@@ -379,71 +486,89 @@ void HNSW::search_layer(Config* config, float* query, vector<Edge*>& path, vecto
 /**
  * Alg 4
  * SELECT-NEIGHBORS-HEURISTIC(q, C, M, lc, extendCandidates, keepPrunedConnections)
- * Given a query and candidates, set candidates to the num_to_return best candidates according to a heuristic
+ * Given a query and candidates, set candidates to the num_to_return best candidates according to a heuristic.
+ * Each candidate's distance must be its distance to query. Distances between candidates are kept in
+ * pair_distances, and looked up there when trimming an overflowing neighbor list.
  */
-void HNSW::select_neighbors_heuristic(Config* config, float* query, vector<Edge>& candidates, int num_to_return, int layer_num, bool extend_candidates, bool keep_pruned) {
-    // Initialize output vector, consider queue, and discard queue
-    auto compare = [](const Edge& lhs, const Edge& rhs) { return lhs.distance > rhs.distance; };
-    vector<Edge> output;
-    priority_queue<Edge, vector<Edge>, decltype(compare)> considered(compare);
-    priority_queue<Edge, vector<Edge>, decltype(compare)> discarded(compare);
-    for (const Edge& candidate : candidates) {
-        considered.emplace(candidate);
-    }
-
-    // Extend candidate list by their neighbors
+void HNSW::select_neighbors_heuristic(Config* config, float* query, vector<Edge>& candidates, int num_to_return, int layer_num, bool extend_candidates, bool keep_pruned, bool is_trimming) {
+    // Copy candidates into a flat scratch list
+    static thread_local vector<Edge> considered;
+    static thread_local vector<int> output;
+    static thread_local vector<int> discarded;
+    static thread_local vector<int> uncached;
+    static thread_local vector<pair<int, float>> computed;
+    considered.assign(candidates.begin(), candidates.end());
+
+    // Extend candidate list by their neighbors that aren't already being considered, then compute their distances
     if (extend_candidates) {
-        for (auto candidate : candidates) {
-            for (const Edge& neighbor : mappings[candidate.target][layer_num]) {
-                // Make sure neighbor isn't already being considered
-                bool is_found = false;
-                priority_queue<Edge, vector<Edge>, decltype(compare)> temp_considered(considered);
-                while (!temp_considered.empty()) {
-                    if (temp_considered.top().target == neighbor.target) {
-                        is_found = true;
-                        break;
-                    }
-                    temp_considered.pop();
-                }
-                if (!is_found) {
-                    considered.emplace(neighbor);
+        size_t num_candidates = considered.size();
+        vector<float*> vectors;
+        for (size_t i = 0; i < num_candidates; ++i) {
+            for (const Edge& neighbor : mappings[considered[i].target][layer_num]) {
+                auto is_same = [&](const Edge& edge) { return edge.target == neighbor.target; };
+                if (none_of(considered.begin(), considered.end(), is_same)) {
+                    considered.push_back(neighbor);
+                    vectors.push_back(nodes[neighbor.target]);
                 }
             }
         }
+        vector<float> distances(vectors.size());
+        calculate_distances(query, vectors.data(), vectors.size(), layer_num, distances.data());
+        for (size_t i = 0; i < vectors.size(); ++i) {
+            considered[num_candidates + i].distance = distances[i];
+        }
     }
-
-    // Add considered element to output if it is closer to query than to other output elements
-    while (!considered.empty() && output.size() < num_to_return) {
-        const Edge& closest = considered.top();
-        float query_distance = calculate_distance(nodes[closest.target], query, num_dimensions, layer_num);
+    stable_sort(considered.begin(), considered.end(), [](const Edge& lhs, const Edge& rhs) { return lhs.distance < rhs.distance; });
+
+    // Add considered element to output if it is closer to query than to other output elements. When trimming,
+    // cached distances are checked first, so a cached closer output element saves computing the others.
+    output.clear();
+    discarded.clear();
+    for (int i = 0; i < considered.size() && output.size() < num_to_return; ++i) {
+        const Edge& closest = considered[i];
         bool is_closer_to_query = true;
-        for (auto n_pair : output) {
-            if (query_distance >= calculate_distance(nodes[closest.target], nodes[n_pair.target], num_dimensions, layer_num)) {
+        uncached.clear();
+        for (int j : output) {
+            float distance;
+            if (!is_trimming || !pair_distances.find(closest.target, considered[j].target, distance)) {
+                uncached.push_back(j);
+            } else if (closest.distance >= distance) {
                 is_closer_to_query = false;
                 break;
             }
         }
+        computed.clear();
+        for (int k = 0; is_closer_to_query && k < uncached.size(); ++k) {
+            const Edge& other = considered[uncached[k]];
+            float distance = calculate_distance(nodes[closest.target], nodes[other.target], num_dimensions, layer_num);
+            computed.emplace_back(other.target, distance);
+            is_closer_to_query = closest.distance < distance;
+        }
+
+        // Keep the distances a later trim may need: all of them when trimming, otherwise those between new neighbors
+        if (is_trimming || is_closer_to_query) {
+            for (const auto& other : computed) {
+                pair_distances.insert(closest.target, other.first, other.second);
+            }
+        }
         if (is_closer_to_query) {
-            output.emplace_back(closest);
+            output.push_back(i);
         } else {
-            discarded.emplace(closest);
+            discarded.push_back(i);
         }
-        considered.pop();
     }
 
     // Add discarded elements until output is large enough
     if (keep_pruned) {
-        while (!discarded.empty() && output.size() < num_to_return) {
-            output.emplace_back(discarded.top());
-            discarded.pop();
+        for (int i = 0; i < discarded.size() && output.size() < num_to_return; ++i) {
+            output.push_back(discarded[i]);
         }
     }
 
     // Set candidates to output
-    candidates.clear();
     candidates.resize(output.size());
     for (int i = 0; i < output.size(); i++) {
-        candidates[i] = output[i];
+        candidates[i] = considered[output[i]];
     }
 }
 
@@ -453,12 +578,17 @@ void HNSW::select_neighbors_heuristic(Config* config, float* query, vector<Edge>
  * This also stores the traversed bottom-layer edges in the path vector
 */
 vector<pair<float, int>> HNSW::nn_search(Config* config, vector<Edge*>& path, pair<int, float*>& query, int num_to_return, bool is_querying, bool is_training, bool is_ignoring, int* total_cost) {
-    // Begin search at the top layer entry point
+    // Begin search at the top layer entry point, or at layer 0 from the centroid table
     vector<pair<float, int>> entry_points;
     entry_points.reserve(config->ef_search);
-    int top = num_layers - 1;
-    float dist = calculate_distance(query.second, nodes[entry_point], num_dimensions, top);
-    entry_points.push_back(make_pair(dist, entry_point));
+    bool use_centroids = config->use_centroid_entry_points && !is_training && !centroid_table.empty();
+    int top = use_centroids ? 0 : num_layers - 1;
+    if (use_centroids) {
+        entry_points = find_centroid_entry_points(config, query.second);
+    } else {
+        float dist = calculate_distance(query.second, nodes[entry_point], num_dimensions, top);
+        entry_points.push_back(make_pair(dist, entry_point));
+    }
     if (config->debug_search)
         cout << "Searching for " << num_to_return << " nearest neighbors of node " << query.first << endl;
 
@@ -494,44 +624,223 @@ vector<pair<float, int>> HNSW::nn_search(Config* config, vector<Edge*>& path, pa
         cout << endl;
     }
 
-    // Return the closest num_return elements from entry_points
+    // Return the closest num_return elements from entry_points using their original IDs
     entry_points.resize(min(entry_points.size(), (size_t)num_to_return));
+    if (!original_ids.empty()) {
+        for (auto& n_pair : entry_points)
+            n_pair.second = original_ids[n_pair.second];
+    }
     return entry_points;
 }
 
-/*
- * Finds the direct path to each nearest neighbor stored in entry_points by
- * backtracking along the beam searched path until a nullptr is reached. This
- * sets the path to the newly found path and deallocates the entry points.
+/**
+ * Searches for a training query on the sampled subgraph and on the original graph,
+ * returning what nn_search would with is_ignoring set and unset. No edges are
+ * ignored above the bottom layer, so the upper layers are descended once, and
+ * the two bottom-layer searches share a cache of distances to the query. The
+ * bottom-layer entry points are copied to layer0_entry_points if it is given.
  */
-void HNSW::find_direct_path(vector<Edge*>& path, vector<pair<float, int>>& entry_points) {
-    set<Edge*> direct_path;
-    for (int i = 0; i < entry_points.size(); i++) {
-        // Find the edge point to approximate nearest neighbor
-        Edge* current = nullptr;
-        for (auto edge : path) {
-            if (edge->target == entry_points[i].second) {
-                current = edge;
-                break;
+void HNSW::dual_search(Config* config, pair<int, float*>& query, int num_to_return, vector<Edge*>& sample_path, vector<Edge*>& original_path,
+                       vector<pair<float, int>>& sample_nearest, vector<pair<float, int>>& original_nearest, vector<pair<float, int>>* layer0_entry_points) {
+    static thread_local DistanceCache cache;
+    cache.reset(num_nodes);
+    long long int descent_start = layer0_dist_comps + upper_dist_comps;
+    vector<pair<float, int>> entry_points = descend_upper_layers(config, query.second);
+    saved_dist_comps += layer0_dist_comps + upper_dist_comps - descent_start;
+    if (layer0_entry_points != nullptr) {
+        *layer0_entry_points = entry_points;
+    }
+
+    // Search the bottom layer of the sampled subgraph, then of the original graph
+    search_bottom_layer(config, query.second, entry_points, num_to_return, sample_path, sample_nearest, true, &cache);
+    search_bottom_layer(config, query.second, entry_points, num_to_return, original_path, original_nearest, false, &cache);
+}
+
+// Builds the centroid table from the current node IDs, so it must be rebuilt after reorder_nodes
+void HNSW::build_centroid_table(Config* config) {
+    auto start = chrono::high_resolution_clock::now();
+    centroid_table.build(config, nodes, num_nodes, num_dimensions);
+    auto end = chrono::high_resolution_clock::now();
+    cout << "Built centroid table with " << centroid_table.num_centroids << " centroids in "
+         << chrono::duration_cast<chrono::milliseconds>(end - start).count() / 1000.0 << " seconds" << endl;
+}
+
+/**
+ * Scans the centroid table for the centroids nearest to the query and returns
+ * their distinct representatives as layer-0 entry points, closest first. The
+ * scan is counted with the upper-layer distance computations it replaces.
+ */
+vector<pair<float, int>> HNSW::find_centroid_entry_points(Config* config, float* query) {
+    vector<int> representatives = centroid_table.find_nearest(query, config->num_centroid_entry_points);
+    upper_dist_comps += centroid_table.num_centroids;
+    sort(representatives.begin(), representatives.end());
+    representatives.erase(unique(representatives.begin(), representatives.end()), representatives.end());
+
+    vector<float*> vectors(representatives.size());
+    for (size_t i = 0; i < representatives.size(); ++i) {
+        vectors[i] = nodes[representatives[i]];
+    }
+    vector<float> distances(representatives.size());
+    calculate_distances(query, vectors.data(), vectors.size(), 0, distances.data());
+    vector<pair<float, int>> entry_points(representatives.size());
+    for (size_t i = 0; i < representatives.size(); ++i) {
+        entry_points[i] = make_pair(distances[i], representatives[i]);
+    }
+    sort(entry_points.begin(), entry_points.end());
+    return entry_points;
+}
+
+/**
+ * Runs k-means on a random sample of 16 nodes per centroid, then maps each
+ * centroid to the sampled node nearest to it. Centroids left without sampled
+ * nodes are dropped. Assignment runs on config->num_threads threads.
+ */
+void CentroidTable::build(Config* config, float** nodes, int num_nodes, int dimensions) {
+    int num_threads = config->num_threads > 0 ? config->num_threads : omp_get_num_procs();
+    num_dimensions = dimensions;
+    int k = min(config->num_centroids, num_nodes);
+    vector<int> sample(num_nodes);
+    for (int i = 0; i < num_nodes; ++i) {
+        sample[i] = i;
+    }
+    shuffle(sample.begin(), sample.end(), mt19937(config->graph_seed));
+    sample.resize(min(num_nodes, k * 16));
+
+    // Seed the centroids with the first sampled nodes
+    centroids.resize(static_cast<size_t>(k) * dimensions);
+    vector<float*> centroid_ptrs(k);
+    for (int c = 0; c < k; ++c) {
+        centroid_ptrs[c] = &centroids[static_cast<size_t>(c) * dimensions];
+        copy(nodes[sample[c]], nodes[sample[c]] + dimensions, centroid_ptrs[c]);
+    }
+
+    vector<int> assignment(sample.size());
+    vector<float> assigned_distances(sample.size());
+    for (int iteration = 0; iteration <= config->centroid_iterations; ++iteration) {
+        // Assign each sampled node to its nearest centroid
+        #pragma omp parallel num_threads(num_threads)
+        {
+            vector<float> distances(k);
+            #pragma omp for schedule(dynamic, 256)
+            for (int i = 0; i < sample.size(); ++i) {
+                calculate_l2_sq_batch(nodes[sample[i]], centroid_ptrs.data(), k, dimensions, distances.data());
+                assignment[i] = min_element(distances.begin(), distances.end()) - distances.begin();
+                assigned_distances[i] = distances[assignment[i]];
             }
         }
-
-        if (current == nullptr) {
-            cerr << "Start edge wasn't found, can't find strict path for entry point " << i << endl;
+        if (iteration == config->centroid_iterations) {
             break;
-        } else {
-            // Traverse back through the path
-            int size = 0;
-            while (size < path.size() && current->prev_edge != nullptr && direct_path.find(current) == direct_path.end()) {
-                direct_path.insert(current);
-                current = current->prev_edge;
-                ++size;
+        }
+
+        // Move each centroid to the mean of its nodes, keeping empty centroids in place
+        vector<double> sums(static_cast<size_t>(k) * dimensions, 0);
+        vector<int> counts(k, 0);
+        for (int i = 0; i < sample.size(); ++i) {
+            double* sum = &sums[static_cast<size_t>(assignment[i]) * dimensions];
+            for (int d = 0; d < dimensions; ++d) {
+                sum[d] += nodes[sample[i]][d];
             }
+            ++counts[assignment[i]];
+        }
+        for (int c = 0; c < k; ++c) {
+            for (int d = 0; counts[c] > 0 && d < dimensions; ++d) {
+                centroid_ptrs[c][d] = sums[static_cast<size_t>(c) * dimensions + d] / counts[c];
+            }
+        }
+    }
+
+    // Map each centroid to its nearest sampled node, then compact away centroids without one
+    vector<float> nearest_distances(k, FLT_MAX);
+    representatives.assign(k, -1);
+    for (int i = 0; i < sample.size(); ++i) {
+        if (assigned_distances[i] < nearest_distances[assignment[i]]) {
+            nearest_distances[assignment[i]] = assigned_distances[i];
+            representatives[assignment[i]] = sample[i];
+        }
+    }
+    num_centroids = 0;
+    for (int c = 0; c < k; ++c) {
+        if (representatives[c] == -1) {
+            continue;
+        }
+        copy(centroid_ptrs[c], centroid_ptrs[c] + dimensions, &centroids[static_cast<size_t>(num_centroids) * dimensions]);
+        representatives[num_centroids++] = representatives[c];
+    }
+    centroids.resize(static_cast<size_t>(num_centroids) * dimensions);
+    representatives.resize(num_centroids);
+}
+
+// Returns the representatives of the num_to_return centroids nearest to the query, nearest first
+vector<int> CentroidTable::find_nearest(float* query, int num_to_return) const {
+    static thread_local vector<float*> centroid_ptrs;
+    static thread_local vector<float> distances;
+    static thread_local vector<int> order;
+    centroid_ptrs.resize(num_centroids);
+    distances.resize(num_centroids);
+    order.resize(num_centroids);
+    for (int c = 0; c < num_centroids; ++c) {
+        centroid_ptrs[c] = const_cast<float*>(&centroids[static_cast<size_t>(c) * num_dimensions]);
+        order[c] = c;
+    }
+    calculate_l2_sq_batch(query, centroid_ptrs.data(), num_centroids, num_dimensions, distances.data());
+    int num_nearest = min(num_to_return, num_centroids);
+    partial_sort(order.begin(), order.begin() + num_nearest, order.end(),
+                 [&](int lhs, int rhs) { return distances[lhs] < distances[rhs] || (distances[lhs] == distances[rhs] && lhs < rhs); });
+    vector<int> nearest(num_nearest);
+    for (int i = 0; i < num_nearest; ++i) {
+        nearest[i] = representatives[order[i]];
+    }
+    return nearest;
+}
+
+// Finds the bottom-layer entry points of a training query through the upper layers
+vector<pair<float, int>> HNSW::descend_upper_layers(Config* config, float* query) {
+    vector<pair<float, int>> entry_points;
+    vector<Edge*> path;
+    entry_points.reserve(config->ef_search);
+    int top = num_layers - 1;
+    float dist = calculate_distance(query, nodes[entry_point], num_dimensions, top);
+    entry_points.push_back(make_pair(dist, entry_point));
+    for (int layer = top; layer >= 1; layer--) {
+        search_layer(config, query, path, entry_points, config->single_ep_training ? 1 : config->ef_search_upper, layer);
+    }
+    return entry_points;
+}
+
+/**
+ * Beam searches the bottom layer for a training query from the given entry points,
+ * keeping the closest num_to_return elements using their original IDs
+ */
+void HNSW::search_bottom_layer(Config* config, float* query, const vector<pair<float, int>>& entry_points, int num_to_return, vector<Edge*>& path,
+                               vector<pair<float, int>>& nearest, bool is_ignoring, DistanceCache* cache) {
+    nearest = entry_points;
+    search_layer(config, query, path, nearest, config->ef_search, 0, false, true, is_ignoring, nullptr, cache);
+    if (config->print_path_size) {
+        total_path_size += path.size();
+    }
+    nearest.resize(min(nearest.size(), (size_t)num_to_return));
+    if (!original_ids.empty()) {
+        for (auto& n_pair : nearest)
+            n_pair.second = original_ids[n_pair.second];
+    }
+}
+
+/*
+ * Finds the direct path to each nearest neighbor stored in entry_points by
+ * following the parents recorded during the search back to an entry point.
+ * Each traced parent is cleared, so paths that merge stop at the shared edge
+ * and every edge is added once. This sets the path to the newly found path.
+ */
+void HNSW::find_direct_path(vector<Edge*>& path, vector<pair<float, int>>& entry_points, vector<pair<int, Edge*>>& parents) {
+    path.clear();
+    for (const pair<float, int>& entry : entry_points) {
+        int current = entry.second;
+        while (parents[current].second != nullptr) {
+            path.push_back(parents[current].second);
+            parents[current].second = nullptr;
+            current = parents[current].first;
         }
     }
-    // Copy direct_path into path parameter
-    vector<Edge*> direct_path_vector(direct_path.begin(), direct_path.end());
-    path = direct_path_vector;
 }
 
 // Returns whether or not to terminate from search_layer
@@ -605,7 +914,21 @@ void HNSW::search_queries(Config* config, float** queries) {
     if (use_groundtruth) {
         load_ivecs(config->groundtruth_file, actual_neighbors, config->num_queries, config->num_return);
     } else {
+        // Search the graph's own vectors, then translate reordered node indices back to original IDs
         knn_search(config, actual_neighbors, nodes, queries);
+        for (vector<int>& neighbors : actual_neighbors) {
+            for (int& neighbor : neighbors) {
+                neighbor = get_original_id(neighbor);
+            }
+        }
+    }
+    // Map original IDs back to node indices to find groundtruth vectors in a reordered graph
+    vector<int> node_indices;
+    if (config->export_queries) {
+        node_indices.resize(num_nodes);
+        for (int i = 0; i < num_nodes; ++i) {
+            node_indices[get_original_id(i)] = i;
+        }
     }
 
     // Initialize calculations per query and oracle calculations
@@ -613,6 +936,7 @@ void HNSW::search_queries(Config* config, float** queries) {
     for (int i = 0; i < 20; i++) {
         counts_calcs.push_back(0);
     }
+    vector<int> counts_latency(20, 0);
     vector<pair<int, int>> nn_calculations;
     if (config->use_calculation_oracle) {
         load_oracle(config, nn_calculations);
@@ -635,12 +959,18 @@ void HNSW::search_queries(Config* config, float** queries) {
         cur_groundtruth = actual_neighbors[i];
         layer0_dist_comps_per_q = 0;
         vector<Edge*> path;
+        auto start = chrono::high_resolution_clock::now();
         vector<pair<float, int>> found = nn_search(config, path, query_pair, config->num_return);
+        auto end = chrono::high_resolution_clock::now();
 
         // Update log files
         if (config->export_calcs_per_query) {
             ++counts_calcs[std::min(19, layer0_dist_comps_per_q / config->interval_for_calcs_histogram)];
         }
+        if (config->export_latency_per_query) {
+            double latency = chrono::duration<double, micro>(end - start).count();
+            ++counts_latency[std::min(19, static_cast<int>(latency / config->interval_for_latency_histogram))];
+        }
         if (config->export_oracle)
             *when_neigh_found_file << endl;
         if (config->print_results) {
@@ -694,7 +1024,7 @@ void HNSW::search_queries(Config* config, float** queries) {
                     *export_file << found[j].second << "," << found[j].first << endl;
                     *export_file << cur_groundtruth[j];
                     if(found[j].second != cur_groundtruth[j]){ 
-                        *export_file << "," << calculate_l2_sq(queries[i], nodes[actual_neighbors[i][j]], config->dimensions);
+                        *export_file << "," << calculate_l2_sq(queries[i], nodes[node_indices[actual_neighbors[i][j]]], config->dimensions);
                     }
                     *export_file<< endl;
                 }
@@ -726,6 +1056,14 @@ void HNSW::search_queries(Config* config, float** queries) {
         histogram << endl;
         histogram.close();
     }
+    if (config->export_latency_per_query) {
+        ofstream histogram = ofstream(config->runs_prefix + "histogram_latency_per_query.txt", std::ios::app);
+        for (int i = 0; i < 20; ++i) {
+            histogram << counts_latency[i] << ",";
+        }
+        histogram << endl;
+        histogram.close();
+    }
     if (config->export_oracle) {
         cout << "Total neighbors found (groundtruth comparison): " << correct_nn_found << " (" << correct_nn_found / (double)(config->num_queries * config->num_return) * 100 << "%)" << endl;
     }
@@ -746,6 +1084,7 @@ void HNSW::search_queries(Config* config, float** queries) {
     if (config->export_oracle) {
         when_neigh_found_file->close();
         delete when_neigh_found_file;
+        when_neigh_found_file = NULL;
         cout << "Exported when neighbors were found to " << config->oracle_file << endl;
     }
 
@@ -837,6 +1176,102 @@ float HNSW::calculate_distance(float* a, float* b, int size, int layer) {
     return calculate_l2_sq(a, b, size);
 }
 
+// Computes the distances from query to count vectors in one batch and updates dist_comps accordingly
+void HNSW::calculate_distances(float* query, float* const* vectors, int count, int layer, float* distances) {
+    if (layer == 0) {
+        layer0_dist_comps += count;
+        layer0_dist_comps_per_q += count;
+    }
+    else if (layer > 0)
+        upper_dist_comps += count;
+    calculate_l2_sq_batch(query, vectors, count, num_dimensions, distances);
+}
+
+/**
+ * Relabels nodes so that bottom-layer neighbors sit close together in memory and
+ * copies the vectors into one slab in the new order. The caller's nodes array is
+ * left untouched, and nn_search and to_files translate back to original IDs.
+ */
+void HNSW::reorder_nodes(Config* config) {
+    auto start = chrono::high_resolution_clock::now();
+    pair_distances.clear();  // Keyed by the old node IDs
+    centroid_table = CentroidTable();
+    vector<vector<int>> adjacency(num_nodes);
+    for (int i = 0; i < num_nodes; ++i) {
+        for (const Edge& edge : mappings[i][0]) {
+            adjacency[i].push_back(edge.target);
+        }
+    }
+    vector<int> order = get_node_order(config, adjacency, entry_point);  // New index to old index
+    if (order.empty()) {
+        return;
+    }
+    vector<int> new_ids(num_nodes);
+    for (int i = 0; i < num_nodes; ++i) {
+        new_ids[order[i]] = i;
+    }
+
+    // Copy adjacency lists in the new order so their allocations are also laid out sequentially
+    vector<vector<vector<Edge>>> new_mappings(num_nodes);
+    for (int i = 0; i < num_nodes; ++i) {
+        new_mappings[i] = mappings[order[i]];
+        for (auto& layer : new_mappings[i]) {
+            for (Edge& edge : layer) {
+                edge.target = new_ids[edge.target];
+            }
+        }
+        vector<vector<Edge>>().swap(mappings[order[i]]);
+    }
+    mappings = std::move(new_mappings);
+    entry_point = new_ids[entry_point];
+
+    // Copy vectors into a slab in the new order
+    float* new_slab = static_cast<float*>(allocate_index_memory(sizeof(float) * num_nodes * num_dimensions, config->use_huge_pages, config->compare_huge_pages));
+    float** new_nodes = new float*[num_nodes];
+    for (int i = 0; i < num_nodes; ++i) {
+        new_nodes[i] = new_slab + static_cast<size_t>(i) * num_dimensions;
+        std::copy(nodes[order[i]], nodes[order[i]] + num_dimensions, new_nodes[i]);
+    }
+    if (node_slab != nullptr) {
+        free_index_memory(node_slab);
+        delete[] nodes;
+    }
+    node_slab = new_slab;
+    nodes = new_nodes;
+
+    // Compose with any earlier reordering
+    vector<int> new_original_ids(num_nodes);
+    for (int i = 0; i < num_nodes; ++i) {
+        new_original_ids[i] = get_original_id(order[i]);
+    }
+    original_ids = std::move(new_original_ids);
+
+    auto end = chrono::high_resolution_clock::now();
+    cout << "Reordered nodes using method " << config->reorder_method << " in "
+         << chrono::duration_cast<chrono::milliseconds>(end - start).count() / 1000.0 << " seconds" << endl;
+}
+
+/**
+ * Copies the graph and its vectors for searching from one NUMA node. The vectors
+ * are bound to numa_node, and the adjacency lists are first touched by this
+ * thread, so call it while pinned to a CPU on that node. The vectors are put on
+ * huge pages if use_huge_pages.
+ */
+HNSW* HNSW::replicate(Config* config, int numa_node, bool use_huge_pages) {
+    HNSW* replica = new HNSW(*this);
+    replica->training_store = nullptr;
+    replica->pair_distances.clear();
+    size_t slab_size = sizeof(float) * num_nodes * num_dimensions;
+    replica->node_slab = static_cast<float*>(allocate_index_memory(slab_size, use_huge_pages, config->compare_huge_pages));
+    bind_to_numa_node(replica->node_slab, slab_size, numa_node);
+    replica->nodes = new float*[num_nodes];
+    for (int i = 0; i < num_nodes; ++i) {
+        replica->nodes[i] = replica->node_slab + static_cast<size_t>(i) * num_dimensions;
+        std::copy(nodes[i], nodes[i] + num_dimensions, replica->nodes[i]);
+    }
+    return replica;
+}
+
 std::ostream& operator<<(std::ostream& os, const HNSW& hnsw) {
     vector<int> nodes_per_layer(hnsw.num_layers);
     for (int i = 0; i < hnsw.num_nodes; ++i) {
@@ -926,7 +1361,7 @@ void HNSW::from_files(Config* config, bool is_benchmarking) {
                 float distance;
                 graph_file.read(reinterpret_cast<char*>(&index), sizeof(index));
                 graph_file.read(reinterpret_cast<char*>(&distance), sizeof(distance));
-                mappings[i][j].emplace_back(Edge(index, distance, config->initial_cost, config->initial_benefit));
+                mappings[i][j].emplace_back(Edge(index, distance));
             }
         }
     }
@@ -949,9 +1384,16 @@ void HNSW::to_files(Config* config, const string& graph_name, long int construct
     // Export graph to file
     ofstream graph_file(config->runs_prefix + "graph_" + graph_name + ".bin");
 
-    // Export edges
+    // Map original IDs back to node indices so reordered graphs are saved in file order
+    vector<int> node_indices(num_nodes);
     for (int i = 0; i < num_nodes; ++i) {
+        node_indices[get_original_id(i)] = i;
+    }
+
+    // Export edges
+    for (int original = 0; original < num_nodes; ++original) {
         // Write number of layers
+        int i = node_indices[original];
         int layers = mappings[i].size();
         graph_file.write(reinterpret_cast<const char*>(&layers), sizeof(layers));
 
@@ -964,13 +1406,15 @@ void HNSW::to_files(Config* config, const string& graph_name, long int construct
             // Write index and distance of each neighbor
             for (int k = 0; k < num_neighbors; ++k) {
                 auto n_pair = mappings[i][j][k];
-                graph_file.write(reinterpret_cast<const char*>(&n_pair.target), sizeof(n_pair.target));
+                int target = get_original_id(n_pair.target);
+                graph_file.write(reinterpret_cast<const char*>(&target), sizeof(target));
                 graph_file.write(reinterpret_cast<const char*>(&n_pair.distance), sizeof(n_pair.distance));
             }
         }
     }
     // Save entry point
-    graph_file.write(reinterpret_cast<const char*>(&entry_point), sizeof(entry_point));
+    int original_entry_point = get_original_id(entry_point);
+    graph_file.write(reinterpret_cast<const char*>(&original_entry_point), sizeof(original_entry_point));
     graph_file.close();
 
     // Export construction parameters
@@ -7,11 +7,14 @@
 #include <queue>
 #include <random>
 #include <functional>
+#include <algorithm>
+#include <cstdint>
 #include <immintrin.h>
+#include <omp.h>
 #include "../config.h"
 #include "utils.h"
 
-extern std::ofstream* debug_file;
+extern thread_local std::ofstream* debug_file;
 
 class Edge {
 public:
@@ -19,21 +22,164 @@ public:
     int target;
     float distance;
 
-    // GraSP
-    Edge* prev_edge;
-    float weight; 
-    float stinky;
+    // GraSP (per-edge training values are kept in TrainingStore at this index)
+    int index;
     bool ignore;
-    float probability_edge;
-    unsigned int num_of_updates; 
-    
-
-    // Cost-Benefit
-    int benefit;
-    int cost;
 
     Edge();
-    Edge(int target, float distance, int initial_cost = 0, int initial_benefit = 0);
+    Edge(int target, float distance);
+};
+
+/**
+ * Structure-of-arrays training state for the bottom-layer edges, indexed by
+ * Edge::index. Weights are stored as fp16, probabilities as 8-bit fractions, and
+ * counters as 16-bit saturating integers, so the per-iteration GraSP sweeps
+ * stream a few bytes per edge instead of whole Edge objects. Counters and stinky
+ * points are updated atomically, so training threads can share one store.
+ */
+class TrainingStore {
+public:
+    size_t num_edges;
+    float temperature;  // Temperature of the last probability update
+    long long num_searched;  // Training queries searched by update_weights so far, used to seed dynamic sampling
+    std::vector<uint16_t> weights;  // fp16, only allocated for GraSP like probabilities, weight_changes and num_of_updates
+    std::vector<uint8_t> probabilities;  // Probability scaled to [0, 255]
+    std::vector<int32_t> stinky;  // Stinky points in units of config->stinky_value
+    std::vector<float> weight_changes;  // Changes summed by update_weights, keeping what the last fp16 update could not represent
+    std::vector<size_t> pending_edges;  // Edges with a nonzero weight_changes left over from the last update_weights call
+    std::vector<uint16_t> num_of_updates;
+    std::vector<uint16_t> costs;  // Only allocated for cost-benefit pruning, like benefits
+    std::vector<uint16_t> benefits;
+
+    TrainingStore(Config* config, std::vector<Edge*>& edges);
+    float get_weight(size_t i) const { return _cvtsh_ss(weights[i]); }
+    void set_weight(size_t i, float weight) { weights[i] = _cvtss_sh(weight, _MM_FROUND_TO_NEAREST_INT); }
+    float get_probability(size_t i) const { return probabilities[i] * (1.0f / 255); }
+    void set_probability(size_t i, float probability) { probabilities[i] = std::min(1.0f, std::max(0.0f, probability)) * 255 + 0.5f; }
+    void add_stinky(size_t i, int points) { __atomic_fetch_add(&stinky[i], points, __ATOMIC_RELAXED); }
+    static void increment(std::vector<uint16_t>& counter, size_t i) {
+        uint16_t count = __atomic_load_n(&counter[i], __ATOMIC_RELAXED);
+        while (count != UINT16_MAX && !__atomic_compare_exchange_n(&counter[i], &count, count + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+    }
+
+    // Sweeps over every edge
+    void shift_weights(float mu, float temperature, int* weight_counts = nullptr, int interval = 1);
+    std::pair<float, float> find_max_min(int* probability_counts = nullptr) const;
+    double sum_probabilities(float mu, float temperature, double* derivative = nullptr) const;
+};
+
+/**
+ * Distances from one query to the nodes it has reached, so that several searches
+ * for the same query compute each distance once. Starting a new query only bumps
+ * the epoch instead of clearing the arrays.
+ */
+class DistanceCache {
+public:
+    void reset(int num_nodes) {
+        if (distances.size() < num_nodes) {
+            distances.resize(num_nodes);
+            epochs.assign(num_nodes, 0);
+        }
+        if (++epoch == 0) {
+            std::fill(epochs.begin(), epochs.end(), 0);
+            epoch = 1;
+        }
+    }
+    bool find(int node, float& distance) const {
+        if (epochs[node] != epoch)
+            return false;
+        distance = distances[node];
+        return true;
+    }
+    void insert(int node, float distance) {
+        distances[node] = distance;
+        epochs[node] = epoch;
+    }
+
+private:
+    std::vector<float> distances;
+    std::vector<uint32_t> epochs;
+    uint32_t epoch = 0;
+};
+
+/**
+ * Direct-mapped cache of distances between pairs of nodes, filled by neighbor
+ * selection during construction. An overflowing neighbor list is trimmed again
+ * each time another node links back to it, and most of its pairs were compared
+ * by the previous trim. Pairs that map to the same slot overwrite each other.
+ */
+class PairDistanceCache {
+public:
+    bool empty() const { return slots.empty(); }
+    void reset(size_t num_slots) {
+        size_t size = 1;
+        while (size < num_slots)
+            size <<= 1;
+        slots.assign(size, Slot{UINT32_MAX, UINT32_MAX, 0});
+        mask = size - 1;
+    }
+    void clear() { std::vector<Slot>().swap(slots); }
+    bool find(uint32_t a, uint32_t b, float& distance) const {
+        if (a > b)
+            std::swap(a, b);
+        const Slot& slot = slots[index(a, b)];
+        if (slot.low != a || slot.high != b)
+            return false;
+        distance = slot.distance;
+        return true;
+    }
+    void insert(uint32_t a, uint32_t b, float distance) {
+        if (a > b)
+            std::swap(a, b);
+        slots[index(a, b)] = Slot{a, b, distance};
+    }
+
+private:
+    struct Slot {
+        uint32_t low;
+        uint32_t high;
+        float distance;
+    };
+    size_t index(uint32_t low, uint32_t high) const { return ((static_cast<uint64_t>(low) << 32 | high) * 0x9E3779B97F4A7C15ULL >> 32) & mask; }
+
+    std::vector<Slot> slots;
+    size_t mask = 0;
+};
+
+/**
+ * K-means centroids of a sample of the nodes, each mapped to the sampled node
+ * nearest to it. The centroids are stored contiguously and scanned with the
+ * batched distance kernel at query start, so that layer-0 search can begin at
+ * nodes near the query without descending the upper layers.
+ */
+class CentroidTable {
+public:
+    int num_centroids = 0;
+    int num_dimensions = 0;
+    std::vector<float> centroids;  // Centroid index, then dimensions
+    std::vector<int> representatives;  // Node nearest to each centroid
+
+    bool empty() const { return num_centroids == 0; }
+    void build(Config* config, float** nodes, int num_nodes, int dimensions);
+    std::vector<int> find_nearest(float* query, int num_to_return) const;
+};
+
+// Snapshot of the search counters kept by each thread
+struct SearchStatistics {
+    long long int layer0_dist_comps = 0;
+    long long int upper_dist_comps = 0;
+    long long int processed_neighbors = 0;
+    long long int total_neighbors = 0;
+    long long int num_distance_termination = 0;
+    long long int num_original_termination = 0;
+    long long int total_path_size = 0;
+    long long int candidates_popped = 0;
+    long long int candidates_size = 0;
+    long long int candidates_without_if = 0;
+    long long int saved_dist_comps = 0;
+    long long int correct_nn_found = 0;
+
+    void add(const SearchStatistics& other);
 };
 
 class HNSW {
@@ -41,6 +187,11 @@ class HNSW {
 public:
     float** nodes; // Node index, then dimensions
     std::vector<std::vector<std::vector<Edge>>> mappings; // Node index, then layer number, then neighbors
+    TrainingStore* training_store; // Bottom-layer training state, only set while training
+    std::vector<int> original_ids; // Node index to index in the loaded file, empty unless reordered
+    float* node_slab; // Contiguous vectors owned by the graph, null if nodes belongs to the caller
+    CentroidTable centroid_table; // Layer-0 entry points for queries, empty unless built
+    PairDistanceCache pair_distances; // Distances compared by select_neighbors_heuristic, only filled during construction
     int entry_point;
     int num_layers;
     int num_nodes;
@@ -50,39 +201,92 @@ public:
     std::mt19937 gen;
     std::uniform_real_distribution<double> dis;
     double normal_factor;
+    static thread_local std::mt19937 sampling_gen;  // Used by dynamic sampling, seeded per training query
 
-    // Statistics
-    int layer0_dist_comps_per_q; 
-    long long int layer0_dist_comps;
-    long long int upper_dist_comps;
-    long long int processed_neighbors;
-    long long int total_neighbors;
-    long long int num_distance_termination; 
-    long long int num_original_termination;
-    long long int total_path_size;
-    long long int candidates_popped;
-    long long int candidates_size;
-    long long int candidates_without_if;
-    std::vector<float> percent_neighbors;
-    std::vector<int> cur_groundtruth;
+    // Statistics, kept per thread so that searches can run in parallel
+    static thread_local int layer0_dist_comps_per_q; 
+    static thread_local long long int layer0_dist_comps;
+    static thread_local long long int upper_dist_comps;
+    static thread_local long long int processed_neighbors;
+    static thread_local long long int total_neighbors;
+    static thread_local long long int num_distance_termination; 
+    static thread_local long long int num_original_termination;
+    static thread_local long long int total_path_size;
+    static thread_local long long int candidates_popped;
+    static thread_local long long int candidates_size;
+    static thread_local long long int candidates_without_if;
+    static thread_local long long int saved_dist_comps;  // Distances reused by dual_search instead of recomputed
+    static thread_local long long int correct_nn_found;  // Groundtruth neighbors reached, counted with groundtruth termination or oracle export
+    static thread_local std::vector<float> percent_neighbors;
+    static thread_local std::vector<int> cur_groundtruth;
 
     HNSW(Config* config, float** nodes);
+    ~HNSW();
     void to_files(Config* config, const std::string& graph_name, long int construction_duration = 0);
     void from_files(Config* config, bool is_benchmarking = false);
     void reset_statistics();
+    SearchStatistics get_statistics() const;
+    void set_statistics(const SearchStatistics& statistics);
     std::vector<Edge*> get_layer_edges(Config* config, int layer);
-    void find_direct_path(std::vector<Edge*>& path, std::vector<std::pair<float, int>>& entry_points);
+    void find_direct_path(std::vector<Edge*>& path, std::vector<std::pair<float, int>>& entry_points, std::vector<std::pair<int, Edge*>>& parents);
     bool should_terminate(Config* config, std::priority_queue<std::pair<float, int>>& top_k, std::pair<float, int>& top_1, float close_squared, float far_squared, bool is_querying, int layer_num, int candidates_popped_per_q);
     float calculate_average_clustering_coefficient();
     float calculate_global_clustering_coefficient();
     float calculate_distance(float* a, float* b, int size, int layer);
+    void calculate_distances(float* query, float* const* vectors, int count, int layer, float* distances);
+    int get_original_id(int node) const { return original_ids.empty() ? node : original_ids[node]; }
+
+    // Node reordering
+    void reorder_nodes(Config* config);
+
+    // Parallel search
+    HNSW* replicate(Config* config, int numa_node, bool use_huge_pages);
+    template <typename Task>
+    void parallel_for(int num_tasks, int num_threads, const std::vector<int>& cpus, Task task);
 
     // Main algorithms
     void insert(Config* config, int query);
-    void search_layer(Config* config, float* query, std::vector<Edge*>& path, std::vector<std::pair<float, int>>& entry_points, int num_to_return, int layer_num, bool is_querying = false, bool is_training = false, bool is_ignoring = false, int* total_cost = nullptr);
-    void select_neighbors_heuristic(Config* config, float* query, std::vector<Edge>& candidates, int num_to_return, int layer_num, bool extend_candidates = false, bool keep_pruned = true);
+    void search_layer(Config* config, float* query, std::vector<Edge*>& path, std::vector<std::pair<float, int>>& entry_points, int num_to_return, int layer_num, bool is_querying = false, bool is_training = false, bool is_ignoring = false, int* total_cost = nullptr, DistanceCache* cache = nullptr);
+    void select_neighbors_heuristic(Config* config, float* query, std::vector<Edge>& candidates, int num_to_return, int layer_num, bool extend_candidates = false, bool keep_pruned = true, bool is_trimming = false);
     std::vector<std::pair<float, int>> nn_search(Config* config, std::vector<Edge*>& path, std::pair<int, float*>& query, int num_to_return, bool is_querying = true, bool is_training = false, bool is_ignoring = false, int* total_cost = nullptr);
+    void dual_search(Config* config, std::pair<int, float*>& query, int num_to_return, std::vector<Edge*>& sample_path, std::vector<Edge*>& original_path,
+                     std::vector<std::pair<float, int>>& sample_nearest, std::vector<std::pair<float, int>>& original_nearest,
+                     std::vector<std::pair<float, int>>* layer0_entry_points = nullptr);
+    void build_centroid_table(Config* config);
+    std::vector<std::pair<float, int>> find_centroid_entry_points(Config* config, float* query);
+    std::vector<std::pair<float, int>> descend_upper_layers(Config* config, float* query);
+    void search_bottom_layer(Config* config, float* query, const std::vector<std::pair<float, int>>& entry_points, int num_to_return, std::vector<Edge*>& path,
+                             std::vector<std::pair<float, int>>& nearest, bool is_ignoring, DistanceCache* cache = nullptr);
     void search_queries(Config* config, float** queries);
 };
 
+/**
+ * Runs task(i, thread) for every i in [0, num_tasks) on num_threads OpenMP threads.
+ * If cpus is not empty, thread t is pinned to cpus[t] while the loop runs. Search
+ * statistics counted by the workers are added to the calling thread's statistics.
+ */
+template <typename Task>
+void HNSW::parallel_for(int num_tasks, int num_threads, const std::vector<int>& cpus, Task task) {
+    SearchStatistics counted;
+    #pragma omp parallel num_threads(num_threads)
+    {
+        int thread = omp_get_thread_num();
+        ThreadPin* pin = cpus.empty() ? nullptr : new ThreadPin({cpus[thread % cpus.size()]});
+        SearchStatistics before = get_statistics();
+        set_statistics(SearchStatistics());
+        #pragma omp for schedule(dynamic, 16)
+        for (int i = 0; i < num_tasks; ++i) {
+            task(i, thread);
+        }
+        SearchStatistics after = get_statistics();
+        set_statistics(before);
+        #pragma omp critical
+        counted.add(after);
+        delete pin;
+    }
+    SearchStatistics total = get_statistics();
+    total.add(counted);
+    set_statistics(total);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,267 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#include <random>
+#include <immintrin.h>
+#include <omp.h>
+#include "layout.h"
+
+using namespace std;
+
+/**
+ * Builds the inline layout from the bottom layer of an HNSW. This should be
+ * called after construction and any GraSP or cost-benefit pruning, since later
+ * changes to hnsw->mappings are not reflected in the records. The records are
+ * put on huge pages if use_huge_pages.
+ */
+InlineLayout::InlineLayout(Config* config, HNSW* hnsw, bool use_huge_pages) : num_nodes(hnsw->num_nodes), num_dimensions(hnsw->num_dimensions), max_degree(0),
+        num_subspaces(min(config->inline_pq_subspaces, hnsw->num_dimensions)) {
+    int num_threads = config->num_threads > 0 ? config->num_threads : omp_get_num_procs();
+
+    // Size records using the largest bottom-layer degree
+    for (int i = 0; i < num_nodes; ++i) {
+        max_degree = max(max_degree, static_cast<int>(hnsw->mappings[i][0].size()));
+    }
+    size_t unpadded_size = sizeof(int) * (1 + max_degree) + static_cast<size_t>(max_degree) * num_subspaces;
+    record_size = (unpadded_size + 63) / 64 * 64;
+    records = static_cast<char*>(allocate_index_memory(record_size * num_nodes, use_huge_pages, config->compare_huge_pages));
+
+    // Split the dimensions into subspaces as evenly as possible
+    subspace_starts.resize(num_subspaces + 1);
+    for (int m = 0; m <= num_subspaces; ++m) {
+        subspace_starts[m] = m * num_dimensions / num_subspaces;
+    }
+    codebooks.resize(256 * static_cast<size_t>(num_dimensions));
+    centroids.resize(256 * static_cast<size_t>(num_subspaces));
+    for (int m = 0; m < num_subspaces; ++m) {
+        int sub_dimensions = subspace_starts[m + 1] - subspace_starts[m];
+        for (int c = 0; c < 256; ++c) {
+            centroids[m * 256 + c] = &codebooks[256 * static_cast<size_t>(subspace_starts[m]) + static_cast<size_t>(c) * sub_dimensions];
+        }
+    }
+
+    // Train each subspace's codebook with k-means over a sample of 16 nodes per centroid
+    vector<int> sample(num_nodes);
+    for (int i = 0; i < num_nodes; ++i) {
+        sample[i] = i;
+    }
+    shuffle(sample.begin(), sample.end(), mt19937(config->graph_seed));
+    sample.resize(min(num_nodes, 256 * 16));
+    #pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1)
+    for (int m = 0; m < num_subspaces; ++m) {
+        int offset = subspace_starts[m];
+        int sub_dimensions = subspace_starts[m + 1] - offset;
+        float** codewords = &centroids[m * 256];
+        for (int c = 0; c < 256; ++c) {
+            float* source = hnsw->nodes[sample[c % sample.size()]] + offset;
+            copy(source, source + sub_dimensions, codewords[c]);
+        }
+        vector<int> assignment(sample.size());
+        vector<float> distances(256);
+        for (int iteration = 0; iteration < config->centroid_iterations; ++iteration) {
+            for (int i = 0; i < sample.size(); ++i) {
+                calculate_l2_sq_batch(hnsw->nodes[sample[i]] + offset, codewords, 256, sub_dimensions, distances.data());
+                assignment[i] = min_element(distances.begin(), distances.end()) - distances.begin();
+            }
+
+            // Move each centroid to the mean of its nodes, keeping empty centroids in place
+            vector<double> sums(256 * static_cast<size_t>(sub_dimensions), 0);
+            vector<int> counts(256, 0);
+            for (int i = 0; i < sample.size(); ++i) {
+                double* sum = &sums[static_cast<size_t>(assignment[i]) * sub_dimensions];
+                for (int d = 0; d < sub_dimensions; ++d) {
+                    sum[d] += hnsw->nodes[sample[i]][offset + d];
+                }
+                ++counts[assignment[i]];
+            }
+            for (int c = 0; c < 256; ++c) {
+                for (int d = 0; counts[c] > 0 && d < sub_dimensions; ++d) {
+                    codewords[c][d] = sums[static_cast<size_t>(c) * sub_dimensions + d] / counts[c];
+                }
+            }
+        }
+    }
+
+    // Encode every node once, then copy its code into each record that points at it
+    node_codes.resize(static_cast<size_t>(num_nodes) * num_subspaces);
+    #pragma omp parallel for num_threads(num_threads) schedule(dynamic, 256)
+    for (int i = 0; i < num_nodes; ++i) {
+        encode(hnsw->nodes[i], &node_codes[static_cast<size_t>(i) * num_subspaces]);
+    }
+    for (int i = 0; i < num_nodes; ++i) {
+        char* record = records + record_size * i;
+        memset(record, 0, record_size);
+        vector<Edge>& neighbors = hnsw->mappings[i][0];
+        int degree = neighbors.size();
+        memcpy(record, &degree, sizeof(int));
+        int* record_neighbors = reinterpret_cast<int*>(record + sizeof(int));
+        uint8_t* record_codes = reinterpret_cast<uint8_t*>(record + sizeof(int) * (1 + max_degree));
+        for (int j = 0; j < degree; ++j) {
+            record_neighbors[j] = neighbors[j].target;
+            memcpy(record_codes + static_cast<size_t>(j) * num_subspaces, &node_codes[static_cast<size_t>(neighbors[j].target) * num_subspaces], num_subspaces);
+        }
+    }
+
+    cout << "Built inline layout with max degree " << max_degree << ", " << num_subspaces << " subspaces and " << record_size
+         << " bytes per record (" << record_size * num_nodes / (1024.0 * 1024.0) << " MiB)" << endl;
+}
+
+InlineLayout::~InlineLayout() {
+    free_index_memory(records);
+}
+
+int InlineLayout::get_degree(int node) const {
+    return *reinterpret_cast<const int*>(records + record_size * node);
+}
+
+const int* InlineLayout::get_neighbors(int node) const {
+    return reinterpret_cast<const int*>(records + record_size * node + sizeof(int));
+}
+
+const uint8_t* InlineLayout::get_codes(int node) const {
+    return reinterpret_cast<const uint8_t*>(records + record_size * node + sizeof(int) * (1 + max_degree));
+}
+
+// Quantizes a vector into the index of its nearest centroid in each subspace
+void InlineLayout::encode(const float* vector, uint8_t* code) const {
+    float distances[256];
+    for (int m = 0; m < num_subspaces; ++m) {
+        int offset = subspace_starts[m];
+        calculate_l2_sq_batch(const_cast<float*>(vector) + offset, &centroids[m * 256], 256, subspace_starts[m + 1] - offset, distances);
+        code[m] = min_element(distances, distances + 256) - distances;
+    }
+}
+
+// Fills table with the squared distance from the query to every centroid, by subspace then code
+void InlineLayout::calculate_distance_table(float* query, float* table) const {
+    for (int m = 0; m < num_subspaces; ++m) {
+        int offset = subspace_starts[m];
+        calculate_l2_sq_batch(query + offset, &centroids[m * 256], 256, subspace_starts[m + 1] - offset, table + m * 256);
+    }
+}
+
+// Calculates the squared Euclidean distance between a query and a code by summing its distance table entries
+float InlineLayout::calculate_code_distance(const float* table, const uint8_t* code) const {
+    float sums[4] = {0, 0, 0, 0};
+    int m = 0;
+    for (; m + 4 <= num_subspaces; m += 4) {
+        sums[0] += table[m * 256 + code[m]];
+        sums[1] += table[(m + 1) * 256 + code[m + 1]];
+        sums[2] += table[(m + 2) * 256 + code[m + 2]];
+        sums[3] += table[(m + 3) * 256 + code[m + 3]];
+    }
+    for (; m < num_subspaces; ++m) {
+        sums[0] += table[m * 256 + code[m]];
+    }
+    return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+}
+
+/**
+ * Searches the upper layers of the HNSW as usual, then beam searches the bottom
+ * layer using the codes stored inside each expanded record. The beam is reranked
+ * with exact distances before returning the closest num_to_return nodes.
+ */
+vector<pair<float, int>> InlineLayout::search(Config* config, HNSW* hnsw, float* query, int num_to_return) {
+    // Find the bottom-layer entry point through the upper layers
+    vector<pair<float, int>> entry_points;
+    vector<Edge*> path;
+    int top = hnsw->num_layers - 1;
+    float dist = hnsw->calculate_distance(query, hnsw->nodes[hnsw->entry_point], num_dimensions, top);
+    entry_points.push_back(make_pair(dist, hnsw->entry_point));
+    for (int layer = top; layer >= 1; layer--) {
+        hnsw->search_layer(config, query, path, entry_points, 1, layer, true);
+    }
+
+    // Beam search the bottom layer with distances looked up from the query's table
+    static thread_local vector<float> table;
+    table.resize(256 * static_cast<size_t>(num_subspaces));
+    calculate_distance_table(query, table.data());
+
+    // Mark visited nodes with the search's epoch, so the flags never need clearing
+    static thread_local vector<uint32_t> visited;
+    static thread_local uint32_t epoch = 0;
+    if (visited.size() < num_nodes) {
+        visited.assign(num_nodes, 0);
+        epoch = 0;
+    }
+    if (++epoch == 0) {
+        fill(visited.begin(), visited.end(), 0);
+        epoch = 1;
+    }
+
+    // Rescore the entry points with their codes, so that the beam compares quantized distances only
+    priority_queue<pair<float, int>, vector<pair<float, int>>, greater<pair<float, int>>> candidates;
+    priority_queue<pair<float, int>> found;
+    for (const auto& entry : entry_points) {
+        visited[entry.second] = epoch;
+        float entry_dist = calculate_code_distance(table.data(), &node_codes[static_cast<size_t>(entry.second) * num_subspaces]);
+        candidates.emplace(entry_dist, entry.second);
+        found.emplace(entry_dist, entry.second);
+    }
+    while (!candidates.empty()) {
+        int closest = candidates.top().second;
+        float close_dist = candidates.top().first;
+        candidates.pop();
+        ++hnsw->candidates_popped;
+        if (close_dist > found.top().first) {
+            break;
+        }
+
+        // Read neighbor IDs and codes from the same record
+        int degree = get_degree(closest);
+        const int* neighbors = get_neighbors(closest);
+        const uint8_t* codes = get_codes(closest);
+        for (int j = 0; j < degree; ++j) {
+            int neighbor = neighbors[j];
+            ++hnsw->candidates_without_if;
+            if (visited[neighbor] == epoch) {
+                continue;
+            }
+            visited[neighbor] = epoch;
+            ++hnsw->layer0_dist_comps;
+            ++hnsw->layer0_dist_comps_per_q;
+            float neighbor_dist = calculate_code_distance(table.data(), codes + static_cast<size_t>(j) * num_subspaces);
+            if (neighbor_dist < found.top().first || found.size() < config->ef_search) {
+                _mm_prefetch(records + record_size * neighbor, _MM_HINT_T0);
+                candidates.emplace(neighbor_dist, neighbor);
+                found.emplace(neighbor_dist, neighbor);
+                ++hnsw->candidates_size;
+                if (found.size() > config->ef_search) {
+                    found.pop();
+                }
+            }
+        }
+    }
+
+    // Rerank the beam using exact distances
+    vector<pair<float, int>> results;
+    results.reserve(found.size());
+    while (!found.empty()) {
+        int node = found.top().second;
+        results.emplace_back(hnsw->calculate_distance(query, hnsw->nodes[node], num_dimensions, 0), node);
+        found.pop();
+    }
+    sort(results.begin(), results.end());
+    results.resize(min(results.size(), static_cast<size_t>(num_to_return)));
+    for (auto& n_pair : results) {
+        n_pair.second = hnsw->get_original_id(n_pair.second);
+    }
+    return results;
+}
+
+// Exports the subspaces, codebooks and raw records to a binary file
+void InlineLayout::to_file(Config* config, const string& graph_name) {
+    string file_name = config->runs_prefix + "inline_" + graph_name + ".bin";
+    ofstream layout_file(file_name, ios::binary | ios::out);
+    layout_file.write(reinterpret_cast<const char*>(&num_nodes), sizeof(num_nodes));
+    layout_file.write(reinterpret_cast<const char*>(&num_dimensions), sizeof(num_dimensions));
+    layout_file.write(reinterpret_cast<const char*>(&max_degree), sizeof(max_degree));
+    layout_file.write(reinterpret_cast<const char*>(&num_subspaces), sizeof(num_subspaces));
+    layout_file.write(reinterpret_cast<const char*>(subspace_starts.data()), sizeof(int) * subspace_starts.size());
+    layout_file.write(reinterpret_cast<const char*>(codebooks.data()), sizeof(float) * codebooks.size());
+    layout_file.write(records, record_size * num_nodes);
+    layout_file.close();
+    cout << "Exported inline layout to " << file_name << endl;
+}
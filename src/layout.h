@@ -0,0 +1,41 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include "hnsw.h"
+
+/**
+ * Read-only copy of an HNSW's bottom layer where each node's record holds its
+ * neighbor IDs followed by product-quantized codes of those neighbors, one byte
+ * per subspace. Expanding a node during search then reads one contiguous record
+ * of a few cache lines instead of chasing an Edge vector and every neighbor's
+ * vector across the heap, and code distances are looked up in a per-query table.
+ */
+class InlineLayout {
+public:
+    int num_nodes;
+    int num_dimensions;
+    int max_degree;
+    int num_subspaces;
+    size_t record_size;  // Bytes per node record, padded to a cache line
+    char* records;  // Degree, then max_degree neighbor IDs and their codes, repeated for each node
+    std::vector<int> subspace_starts;  // First dimension of each subspace, then num_dimensions
+    std::vector<float> codebooks;  // Subspace, then 256 centroids over its dimensions
+    std::vector<float*> centroids;  // Subspace * 256 + code, pointing into codebooks
+    std::vector<uint8_t> node_codes;  // Node index * num_subspaces, then the code of each subspace
+
+    InlineLayout(Config* config, HNSW* hnsw, bool use_huge_pages);
+    ~InlineLayout();
+    int get_degree(int node) const;
+    const int* get_neighbors(int node) const;
+    const uint8_t* get_codes(int node) const;
+    void encode(const float* vector, uint8_t* code) const;
+    void calculate_distance_table(float* query, float* table) const;
+    float calculate_code_distance(const float* table, const uint8_t* code) const;
+    std::vector<std::pair<float, int>> search(Config* config, HNSW* hnsw, float* query, int num_to_return);
+    void to_file(Config* config, const std::string& graph_name);
+};
+
+#endif
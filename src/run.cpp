@@ -4,6 +4,7 @@
 #include <string.h>
 #include "grasp.h"
 #include "hnsw.h"
+#include "layout.h"
 
 using namespace std;
 
@@ -21,7 +22,7 @@ int main() {
         << ", ef_search = " << config->ef_search << "\nnum_return = " << config->num_return
         << ", learning_rate = " << config->learning_rate << ", initial_temperature = " << config->initial_temperature
         << ", decay_factor = " << config->decay_factor << ", initial_keep_ratio = " << config->initial_keep_ratio
-        << ", final_keep_ratio = " << config->final_keep_ratio << ", grasp_loops = " << config->grasp_loops  
+        << ", final_keep_ratio = " << config->final_keep_ratio << ", grasp_loops = " << config->grasp_loops << ", grasp_batch_size = " << config->grasp_batch_size  
         <<"\nCurrent Run Properties: Stinky Values = "  << std::boolalpha  <<  config->use_stinky_points << " [" <<config->stinky_value <<"]" 
         << ", use_heuristic = " << config->use_heuristic << ", use_grasp = " << config->use_grasp << ", use_dynamic_sampling = " << config->use_dynamic_sampling 
         << ", Single search point = " << config->single_ep_construction  << ", current Pruning method = " << config->weight_selection_method   
@@ -47,8 +48,12 @@ int main() {
     }
 
     // Load nodes
+    apply_numa_policy(config);
     float** nodes = new float*[config->num_nodes];
     load_nodes(config, nodes);
+    if (config->use_huge_pages) {
+        print_huge_page_report();
+    }
     float** queries = new float*[config->num_queries];
     load_queries(config, nodes, queries);
     
@@ -61,6 +66,7 @@ int main() {
         for (int i = 1; i < config->num_nodes; i++) {
             hnsw->insert(config, i);
         }
+        hnsw->pair_distances.clear();  // Only used while inserting
         // Optimize HNSW using GraSP
         if (config->use_grasp) {
             float** training = new float*[config->num_training];
@@ -98,6 +104,16 @@ int main() {
         }
     }
 
+    // Relabel nodes for memory locality
+    if (config->reorder_method != 0) {
+        hnsw->reorder_nodes(config);
+    }
+
+    // Build the centroid table from the final node IDs
+    if (config->use_centroid_entry_points) {
+        hnsw->build_centroid_table(config);
+    }
+
     // Print and export HNSW graph
     if (config->print_graph) {
         cout << hnsw;
@@ -105,6 +121,10 @@ int main() {
     if (config->export_graph && !config->load_graph_file) {
         hnsw->to_files(config, "run");
     }
+    if (config->export_inline_layout) {
+        InlineLayout layout(config, hnsw, config->use_huge_pages);
+        layout.to_file(config, "run");
+    }
 
     // Run queries
     if (config->run_search) {
@@ -133,9 +153,7 @@ int main() {
     }
 
     // Clean up
-    for (int i = 0; i < config->num_nodes; i++)
-        delete[] nodes[i];
-    delete[] nodes;
+    free_nodes(nodes);
     delete hnsw;
     delete config;
 
@@ -0,0 +1,32 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include "vamana.h"
+
+using namespace std;
+
+int main() {
+    // Construct Vamana index
+    Config* config = new Config();
+    auto start = std::chrono::high_resolution_clock::now();
+    Graph G = Vamana(config, config->vamana_alpha, config->vamana_ef_construction, config->vamana_max_connections);
+    auto stop = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+    if (config->reorder_method != 0) {
+        G.reorderNodes(config);
+    }
+
+    if (config->export_graph) {
+        G.to_files(config, "vamana");
+    }
+
+    // Search queries from the start points found during construction, which reports per-query statistics
+    std::cout << "Duration of Vamana: "<< duration.count()/1000 << " millisecond(s)" << endl;
+    G.queryTest(config);
+    vector<vector<size_t>> allResults = G.query(config);
+    cout << "sizeall: " << allResults.size() << ", size 0 " << allResults[0].size() <<endl; 
+    // G.sanityCheck(config->groundtruth_file, allResults);
+    // print_100_nodes(G, config);
+    // Clean up
+    delete config;
+}
@@ -1,7 +1,14 @@
 #include <immintrin.h>
+#include <algorithm>
 #include <fstream>
 #include <queue>
 #include <random>
+#include <map>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <linux/mempolicy.h>
 #include "utils.h"
 
 using namespace std;
@@ -43,6 +50,70 @@ float calculate_l2_sq(float* a, float* b, int dimensions) {
     return sum[0] + remainder;
 }
 
+// Adds the lanes of a partial sum and the remaining dimensions in the same order as calculate_l2_sq
+static inline float finish_l2_sq(__m256 result, const float* a, const float* b, int start, int dimensions) {
+    float remainder = 0;
+    for (int i = start; i < dimensions; ++i) {
+        float diff = a[i] - b[i];
+        remainder += diff * diff;
+    }
+    float sum[8];
+    _mm256_storeu_ps(sum, result);
+    for (int i = 1; i < 8; ++i) {
+        sum[0] += sum[i];
+    }
+    return sum[0] + remainder;
+}
+
+/**
+ * Calculates the squared Euclidean distances from a query to count vectors. Four
+ * vectors are processed at a time, so each block of the query is loaded once and
+ * the four vector loads are interleaved. The results match calculate_l2_sq exactly.
+ */
+void calculate_l2_sq_batch(float* query, float* const* vectors, int count, int dimensions, float* distances) {
+    int parts = dimensions / 8;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const float* v0 = vectors[i];
+        const float* v1 = vectors[i + 1];
+        const float* v2 = vectors[i + 2];
+        const float* v3 = vectors[i + 3];
+        __m256 r0 = _mm256_setzero_ps();
+        __m256 r1 = _mm256_setzero_ps();
+        __m256 r2 = _mm256_setzero_ps();
+        __m256 r3 = _mm256_setzero_ps();
+        for (int p = 0; p < parts; ++p) {
+            __m256 q = _mm256_loadu_ps(query + p * 8);
+            __m256 d0 = _mm256_sub_ps(q, _mm256_loadu_ps(v0 + p * 8));
+            __m256 d1 = _mm256_sub_ps(q, _mm256_loadu_ps(v1 + p * 8));
+            __m256 d2 = _mm256_sub_ps(q, _mm256_loadu_ps(v2 + p * 8));
+            __m256 d3 = _mm256_sub_ps(q, _mm256_loadu_ps(v3 + p * 8));
+            r0 = _mm256_add_ps(r0, _mm256_mul_ps(d0, d0));
+            r1 = _mm256_add_ps(r1, _mm256_mul_ps(d1, d1));
+            r2 = _mm256_add_ps(r2, _mm256_mul_ps(d2, d2));
+            r3 = _mm256_add_ps(r3, _mm256_mul_ps(d3, d3));
+        }
+        distances[i] = finish_l2_sq(r0, query, v0, parts * 8, dimensions);
+        distances[i + 1] = finish_l2_sq(r1, query, v1, parts * 8, dimensions);
+        distances[i + 2] = finish_l2_sq(r2, query, v2, parts * 8, dimensions);
+        distances[i + 3] = finish_l2_sq(r3, query, v3, parts * 8, dimensions);
+    }
+    for (; i < count; ++i) {
+        distances[i] = calculate_l2_sq(query, vectors[i], dimensions);
+    }
+}
+
+// Calculates the squared Euclidean distance between every pair of count vectors into a count x count matrix
+void calculate_l2_sq_pairwise(float* const* vectors, int count, int dimensions, float* distances) {
+    for (int i = 0; i < count; ++i) {
+        distances[i * count + i] = 0;
+        calculate_l2_sq_batch(vectors[i], vectors + i + 1, count - i - 1, dimensions, distances + i * count + i + 1);
+        for (int j = i + 1; j < count; ++j) {
+            distances[j * count + i] = distances[i * count + j];
+        }
+    }
+}
+
 // Finds the nearest neighbors from nodes to each query using an exact KNN search
 void knn_search(Config* config, vector<vector<int>>& results, float** nodes, float** queries) {
     results.resize(config->num_queries);
@@ -68,7 +139,7 @@ void knn_search(Config* config, vector<vector<int>>& results, float** nodes, flo
 }
 
 // Loads num vectors with dim values from fvecs file
-void load_fvecs(const string& file, float** vectors, int num, int dim, bool check_groundtruth) {
+void load_fvecs(const string& file, float** vectors, int num, int dim, bool check_groundtruth, float* slab) {
     // Open file
     ifstream f(file, ios::binary | ios::in);
     if (!f) {
@@ -102,8 +173,8 @@ void load_fvecs(const string& file, float** vectors, int num, int dim, bool chec
     for (int i = 0; i < num; i++) {
         // Skip dimension size
         f.seekg(4, ios::cur);
-        // Read point
-        vectors[i] = new float[dim];
+        // Read point into its own allocation or its place in the slab
+        vectors[i] = slab != nullptr ? slab + static_cast<size_t>(i) * dim : new float[dim];
         f.read(reinterpret_cast<char*>(vectors[i]), dim * 4);
     }
     f.close();
@@ -187,12 +258,17 @@ void save_ivecs(const string& file, vector<vector<int>>& vectors) {
     f.close();
 }
 
-// Loads nodes from text file, fvecs file, or random generation
+// Loads nodes from text file, fvecs file, or random generation into one slab
 void load_nodes(Config* config, float** nodes) {
+    float* slab = static_cast<float*>(allocate_index_memory(sizeof(float) * config->num_nodes * config->dimensions, config->use_huge_pages, config->compare_huge_pages));
+    for (int i = 0; i < config->num_nodes; i++) {
+        nodes[i] = slab + static_cast<size_t>(i) * config->dimensions;
+    }
+
     if (config->load_file != "") {
         // Load nodes from fvecs file
         if (config->load_file.size() >= 6 && config->load_file.substr(config->load_file.size() - 6) == ".fvecs") {
-            load_fvecs(config->load_file, nodes, config->num_nodes, config->dimensions, config->groundtruth_file != "");
+            load_fvecs(config->load_file, nodes, config->num_nodes, config->dimensions, config->groundtruth_file != "", slab);
             return;
         }
         // Load nodes from text file
@@ -203,7 +279,6 @@ void load_nodes(Config* config, float** nodes) {
         }
         cout << "Loading " << config->num_nodes << " nodes from file " << config->load_file << endl;
         for (int i = 0; i < config->num_nodes; i++) {
-            nodes[i] = new float[config->dimensions];
             for (int j = 0; j < config->dimensions; j++) {
                 f >> nodes[i][j];
             }
@@ -217,13 +292,18 @@ void load_nodes(Config* config, float** nodes) {
     mt19937 gen(config->graph_seed);
     uniform_real_distribution<float> dis(config->gen_min, config->gen_max);
     for (int i = 0; i < config->num_nodes; i++) {
-        nodes[i] = new float[config->dimensions];
         for (int j = 0; j < config->dimensions; j++) {
             nodes[i][j] = round(dis(gen) * pow(10, config->gen_decimals)) / pow(10, config->gen_decimals);
         }
     }
 }
 
+// Frees nodes loaded by load_nodes
+void free_nodes(float** nodes) {
+    free_index_memory(nodes[0]);
+    delete[] nodes;
+}
+
 // Loads queries from text file, fvecs file, or random generation
 void load_queries(Config* config, float** nodes, float** queries) {
     mt19937 gen(config->query_seed);
@@ -306,3 +386,331 @@ void load_oracle(Config* config, vector<pair<int, int>>& results) {
     f.close();
     std::sort(results.begin(), results.end());
 }
+
+
+// Size and backing of each live allocation made by allocate_index_memory
+struct IndexAllocation {
+    size_t bytes;
+    bool is_hugetlb;
+    bool is_transparent;
+};
+static map<void*, IndexAllocation> index_allocations;
+
+/**
+ * Allocates page-aligned memory for large, randomly accessed index arrays. With
+ * use_huge_pages, this first tries explicit 2MB pages (MAP_HUGETLB), then falls
+ * back to 4KB pages advised for transparent huge pages. Without it, the kernel's
+ * transparent huge page policy applies as it does to any other allocation,
+ * unless keep_small_pages disables transparent huge pages for comparisons.
+ */
+void* allocate_index_memory(size_t bytes, bool use_huge_pages, bool keep_small_pages) {
+    const size_t huge_page_size = 2 * 1024 * 1024;
+    size_t rounded_bytes = (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+    IndexAllocation allocation = {rounded_bytes, false, false};
+    void* memory = MAP_FAILED;
+    if (use_huge_pages) {
+        memory = mmap(nullptr, rounded_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        allocation.is_hugetlb = memory != MAP_FAILED;
+    }
+    if (memory == MAP_FAILED) {
+        memory = mmap(nullptr, rounded_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            cout << "Unable to allocate " << bytes << " bytes of index memory" << endl;
+            exit(-1);
+        }
+        allocation.is_transparent = use_huge_pages && madvise(memory, rounded_bytes, MADV_HUGEPAGE) == 0;
+        if (!use_huge_pages && keep_small_pages) {
+            madvise(memory, rounded_bytes, MADV_NOHUGEPAGE);
+        }
+    }
+    index_allocations[memory] = allocation;
+    return memory;
+}
+
+// Frees memory returned by allocate_index_memory
+void free_index_memory(void* memory) {
+    auto allocation = index_allocations.find(memory);
+    if (allocation == index_allocations.end()) {
+        return;
+    }
+    munmap(memory, allocation->second.bytes);
+    index_allocations.erase(allocation);
+}
+
+// Prints how much index memory was requested with each backing and how much the kernel backs with huge pages
+void print_huge_page_report() {
+    size_t total_bytes = 0;
+    size_t hugetlb_bytes = 0;
+    size_t transparent_bytes = 0;
+    for (const auto& allocation : index_allocations) {
+        total_bytes += allocation.second.bytes;
+        if (allocation.second.is_hugetlb)
+            hugetlb_bytes += allocation.second.bytes;
+        if (allocation.second.is_transparent)
+            transparent_bytes += allocation.second.bytes;
+    }
+    const double mib = 1024.0 * 1024.0;
+    cout << "Index memory: " << total_bytes / mib << " MiB, explicit huge pages: " << hugetlb_bytes / mib
+         << " MiB, advised for transparent huge pages: " << transparent_bytes / mib << " MiB";
+
+    // Transparent huge pages are only promoted as the kernel finds free 2MB regions, so report what is actually backed
+    ifstream smaps("/proc/self/smaps_rollup");
+    string key;
+    size_t kilobytes;
+    while (smaps >> key) {
+        if (key == "AnonHugePages:" && smaps >> kilobytes) {
+            cout << ", transparent huge pages in use: " << kilobytes / 1024.0 << " MiB";
+            break;
+        }
+    }
+    cout << endl;
+}
+
+ThreadPin::ThreadPin(const vector<int>& cpus) {
+    pinned = sched_getaffinity(0, sizeof(previous), &previous) == 0;
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &cpu_set);
+    }
+    if (pinned && sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0) {
+        pinned = false;
+    }
+}
+
+ThreadPin::~ThreadPin() {
+    if (pinned) {
+        sched_setaffinity(0, sizeof(previous), &previous);
+    }
+}
+
+/**
+ * Returns the CPUs of each NUMA node, indexed by node ID, from /sys/devices/system/node. Machines
+ * without NUMA information are treated as one node holding every online CPU.
+ */
+vector<vector<int>> get_numa_node_cpus() {
+    vector<vector<int>> node_cpus;
+    for (int node = 0; ; ++node) {
+        ifstream cpu_list("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        if (!cpu_list) {
+            break;
+        }
+        // Parse ranges such as "0-15,32-47"
+        vector<int> cpus;
+        string range;
+        while (getline(cpu_list, range, ',')) {
+            if (range.empty() || range == "\n") {
+                continue;
+            }
+            size_t dash = range.find('-');
+            int first = stoi(range.substr(0, dash));
+            int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        // Memory-only nodes are kept with no CPUs so indices match node IDs
+        node_cpus.push_back(cpus);
+    }
+    if (node_cpus.empty()) {
+        vector<int> cpus(sysconf(_SC_NPROCESSORS_ONLN));
+        for (size_t cpu = 0; cpu < cpus.size(); ++cpu) {
+            cpus[cpu] = cpu;
+        }
+        node_cpus.push_back(cpus);
+    }
+    return node_cpus;
+}
+
+/**
+ * With numa_policy = 1, interleaves all memory allocated afterwards across NUMA
+ * nodes, so the vectors and adjacency lists are spread over every memory
+ * controller instead of landing on the node of the thread that loaded them.
+ * This should be called before loading nodes or building the graph.
+ */
+void apply_numa_policy(Config* config) {
+    if (config->numa_policy != 1) {
+        return;
+    }
+    unsigned long node_mask = 0;
+    int num_nodes = 0;
+    while (num_nodes < 64 && access(("/sys/devices/system/node/node" + to_string(num_nodes)).c_str(), F_OK) == 0) {
+        node_mask |= 1UL << num_nodes;
+        ++num_nodes;
+    }
+    if (num_nodes <= 1) {
+        cout << "Warning: Only one NUMA node found, so memory will not be interleaved" << endl;
+        return;
+    }
+    if (syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, &node_mask, sizeof(node_mask) * 8) != 0) {
+        cout << "Warning: Unable to interleave memory across " << num_nodes << " NUMA nodes" << endl;
+        return;
+    }
+    cout << "Interleaving memory across " << num_nodes << " NUMA nodes" << endl;
+}
+
+// Binds untouched memory from allocate_index_memory to one NUMA node
+void bind_to_numa_node(void* memory, size_t bytes, int numa_node) {
+    if (numa_node < 0 || numa_node >= 64) {
+        return;
+    }
+    unsigned long node_mask = 1UL << numa_node;
+    const size_t huge_page_size = 2 * 1024 * 1024;
+    size_t rounded_bytes = (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+    if (syscall(SYS_mbind, memory, rounded_bytes, MPOL_BIND, &node_mask, sizeof(node_mask) * 8, 0) != 0) {
+        cout << "Warning: Unable to bind index memory to NUMA node " << numa_node << endl;
+    }
+}
+
+// Orders nodes by breadth-first search, starting from root
+vector<int> get_bfs_order(const vector<vector<int>>& adjacency, int root) {
+    int num_nodes = adjacency.size();
+    vector<int> order;
+    order.reserve(num_nodes);
+    vector<bool> visited(num_nodes, false);
+    int next_unvisited = 0;
+    while (order.size() < num_nodes) {
+        // Start a new traversal for each disconnected component
+        while (visited[root])
+            root = next_unvisited++;
+        visited[root] = true;
+        size_t head = order.size();
+        order.push_back(root);
+        while (head < order.size()) {
+            for (int neighbor : adjacency[order[head]]) {
+                if (!visited[neighbor]) {
+                    visited[neighbor] = true;
+                    order.push_back(neighbor);
+                }
+            }
+            ++head;
+        }
+    }
+    return order;
+}
+
+// Orders nodes by reverse Cuthill-McKee, visiting lower degree neighbors first
+vector<int> get_rcm_order(const vector<vector<int>>& adjacency) {
+    int num_nodes = adjacency.size();
+    vector<int> by_degree(num_nodes);
+    for (int i = 0; i < num_nodes; ++i) {
+        by_degree[i] = i;
+    }
+    auto degree_compare = [&adjacency](int lhs, int rhs) {
+        return adjacency[lhs].size() < adjacency[rhs].size() || (adjacency[lhs].size() == adjacency[rhs].size() && lhs < rhs);
+    };
+    std::stable_sort(by_degree.begin(), by_degree.end(), degree_compare);
+
+    vector<int> order;
+    order.reserve(num_nodes);
+    vector<bool> visited(num_nodes, false);
+    vector<int> neighbors;
+    for (int root : by_degree) {
+        // Start each component from its lowest degree node
+        if (visited[root])
+            continue;
+        visited[root] = true;
+        size_t head = order.size();
+        order.push_back(root);
+        while (head < order.size()) {
+            neighbors.clear();
+            for (int neighbor : adjacency[order[head]]) {
+                if (!visited[neighbor]) {
+                    visited[neighbor] = true;
+                    neighbors.push_back(neighbor);
+                }
+            }
+            std::sort(neighbors.begin(), neighbors.end(), degree_compare);
+            order.insert(order.end(), neighbors.begin(), neighbors.end());
+            ++head;
+        }
+    }
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+/**
+ * Orders nodes with Gorder's greedy heuristic: the next node is the one sharing the
+ * most neighbors and edges with the last 'window' placed nodes. Scores are kept in a
+ * lazily updated max-heap. Placement starts from root.
+ */
+vector<int> get_gorder_order(const vector<vector<int>>& adjacency, int root, int window) {
+    // Build reverse adjacency
+    int num_nodes = adjacency.size();
+    vector<vector<int>> in_neighbors(num_nodes);
+    for (int i = 0; i < num_nodes; ++i) {
+        for (int neighbor : adjacency[i]) {
+            in_neighbors[neighbor].push_back(i);
+        }
+    }
+
+    vector<int> order;
+    order.reserve(num_nodes);
+    vector<int> scores(num_nodes, 0);
+    vector<bool> placed(num_nodes, false);
+    priority_queue<pair<int, int>> heap;
+    // Adds delta to every unplaced node that is a neighbor or sibling of v
+    auto update_scores = [&](int v, int delta) {
+        auto update = [&](int u) {
+            if (!placed[u]) {
+                scores[u] += delta;
+                if (delta > 0)
+                    heap.emplace(scores[u], -u);
+            }
+        };
+        for (int neighbor : adjacency[v])
+            update(neighbor);
+        for (int parent : in_neighbors[v]) {
+            update(parent);
+            for (int sibling : adjacency[parent])
+                if (sibling != v)
+                    update(sibling);
+        }
+    };
+
+    int next_unplaced = 0;
+    int next = root;
+    while (order.size() < num_nodes) {
+        placed[next] = true;
+        order.push_back(next);
+        update_scores(next, 1);
+        if (order.size() > window) {
+            update_scores(order[order.size() - window - 1], -1);
+        }
+
+        // Pop the highest scoring unplaced node, refreshing stale heap entries
+        next = -1;
+        while (!heap.empty()) {
+            int score = heap.top().first;
+            int node = -heap.top().second;
+            heap.pop();
+            if (placed[node])
+                continue;
+            if (score != scores[node]) {
+                if (scores[node] > 0)
+                    heap.emplace(scores[node], -node);
+                continue;
+            }
+            next = node;
+            break;
+        }
+        if (next == -1 && order.size() < num_nodes) {
+            while (placed[next_unplaced])
+                ++next_unplaced;
+            next = next_unplaced;
+        }
+    }
+    return order;
+}
+
+// Returns the node order of config->reorder_method as new index to old index, or nothing if nodes are not reordered
+vector<int> get_node_order(Config* config, const vector<vector<int>>& adjacency, int root) {
+    if (config->reorder_method == 1) {
+        return get_bfs_order(adjacency, root);
+    } else if (config->reorder_method == 2) {
+        return get_rcm_order(adjacency);
+    } else if (config->reorder_method == 3) {
+        return get_gorder_order(adjacency, root, config->gorder_window);
+    }
+    return {};
+}
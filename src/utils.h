@@ -2,16 +2,40 @@
 #define UTILS_H
 
 #include <vector>
+#include <sched.h>
 #include "../config.h"
 
+// Restricts the calling thread to a set of CPUs until destroyed
+class ThreadPin {
+public:
+    ThreadPin(const std::vector<int>& cpus);
+    ~ThreadPin();
+private:
+    cpu_set_t previous;
+    bool pinned;
+};
+
 float calculate_l2_sq(float* a, float* b, int size);
+void calculate_l2_sq_batch(float* query, float* const* vectors, int count, int dimensions, float* distances);
+void calculate_l2_sq_pairwise(float* const* vectors, int count, int dimensions, float* distances);
 void knn_search(Config* config, std::vector<std::vector<int>>& results, float** nodes, float** queries);
-void load_fvecs(const std::string& file, float** results, int num, int dim, bool check_groundtruth = false);
+void load_fvecs(const std::string& file, float** results, int num, int dim, bool check_groundtruth = false, float* slab = nullptr);
 void save_fvecs(const std::string& file, float** results, int num, int dim);
 void load_ivecs(const std::string& file, std::vector<std::vector<int>>& results, int num, int dim);
 void save_ivecs(const std::string& file, std::vector<std::vector<int>>& results);
 void load_nodes(Config* config, float** nodes);
+void free_nodes(float** nodes);
 void load_queries(Config* config, float** nodes, float** queries);
 void load_oracle(Config* config, std::vector<std::pair<int, int>>& result);
+void* allocate_index_memory(size_t bytes, bool use_huge_pages, bool keep_small_pages = false);
+void free_index_memory(void* memory);
+void print_huge_page_report();
+std::vector<std::vector<int>> get_numa_node_cpus();
+void apply_numa_policy(Config* config);
+void bind_to_numa_node(void* memory, size_t bytes, int numa_node);
+std::vector<int> get_bfs_order(const std::vector<std::vector<int>>& adjacency, int root);
+std::vector<int> get_rcm_order(const std::vector<std::vector<int>>& adjacency);
+std::vector<int> get_gorder_order(const std::vector<std::vector<int>>& adjacency, int root, int window);
+std::vector<int> get_node_order(Config* config, const std::vector<std::vector<int>>& adjacency, int root);
 
 #endif
\ No newline at end of file
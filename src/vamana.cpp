@@ -1,12 +1,13 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
-#include <set>
 #include <random>
 #include <algorithm>
 #include <chrono>
 #include <thread>
 #include <queue>
+#include <cstdint>
+#include <omp.h>
 #include <immintrin.h>
 #include "vamana.h"
 
@@ -22,40 +23,10 @@
 using namespace std;
 
 
-int distanceCalculationCount = 0;
-int alpha = 1.2;
-int K = 30; // Num of NNs when building Vamana graph
-int K_QUERY = 100; // Num of NNs found for each query
-int K_TRUTH = 100; // Num of NNs provided by ground truth for each query
-int R = 50; // Max outedge
-int L = 100; // beam search width
-int L_QUERY = 100;
-
-int main() {
-    // Construct Vamana index
-    Config* config = new Config();
-    auto start = std::chrono::high_resolution_clock::now();
-    Graph G = Vamana(config, alpha, K, R);
-    auto stop = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-
-    // Search queries
-    size_t entry = findStart(config, G);
-    G.queryTest(entry);
-    start = std::chrono::high_resolution_clock::now();
-    distanceCalculationCount = 0;
-    vector<vector<size_t>> allResults = G.query(config, entry);
-    cout << "sizeall: " << allResults.size() << ", size 0 " << allResults[0].size() <<endl; 
-    stop = std::chrono::high_resolution_clock::now();
-    auto duration2 = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-    // G.sanityCheck(config->groundtruth_file, allResults);
-    std::cout << "Duration of Vamana: "<< duration.count()/1000 << " millisecond(s)" << endl;
-    cout << "Duration of Each Query: "<< duration2.count()/1000/config->num_queries << " millisecond(s)"<< endl;
-    cout << "Number of distance calculation per query: " << distanceCalculationCount/config->num_queries << endl;
-    // print_100_nodes(G, config);
-    // Clean up
-    delete config;
-}
+thread_local long long int distanceCalculationCount = 0;
+thread_local long long int hopCount = 0;
+thread_local long long int distanceTerminationCount = 0;
+thread_local long long int originalTerminationCount = 0;
 
 // ostream& operator<<(ostream& os, const DataNode& rhs) {
 //     for (size_t i = 0; i < DIMENSION; i++) {
@@ -132,47 +103,73 @@ int main() {
 ostream& operator<<(ostream& os, const Graph& rhs) {
     for (size_t i = 0; i < rhs.num_nodes; i++) {
         cout << i << " : ";
-        for (size_t neighbor : rhs.mappings[i]) {
-            cout << neighbor << " ";
+        const uint32_t* neighbors = rhs.getNeighbors(i);
+        for (uint32_t j = 0; j < rhs.getDegree(i); j++) {
+            cout << neighbors[j] << " ";
         }
         cout << endl;
     }
     return os;
 }
 
-Graph::Graph(Config* config) {
+Graph::Graph(Config* config, int R) : Graph(config, new float*[config->num_nodes], R) {
+    load_nodes(config, nodes);
+    owns_nodes = true;
+}
+
+// Links the caller's vectors, which must outlive the graph
+Graph::Graph(Config* config, float** nodes, int R) : nodes(nodes), owns_nodes(false), R(R) {
     num_nodes = config->num_nodes;
     DIMENSION = config->dimensions;
-    nodes = new float*[config->num_nodes];
-    load_nodes(config, nodes);
-    mappings.resize(num_nodes);
-    for (int i = 0; i < mappings.size(); i++) {
-        mappings[i] = {};
-    }
+    neighbors.assign(static_cast<size_t>(num_nodes) * R, 0);
+    degrees.assign(num_nodes, 0);
+}
+
+// Takes over the other graph's vectors, so that only this graph frees them
+Graph::Graph(Graph&& other) : nodes(other.nodes), owns_nodes(other.owns_nodes), neighbors(std::move(other.neighbors)), degrees(std::move(other.degrees)),
+        starts(std::move(other.starts)), original_ids(std::move(other.original_ids)), R(other.R), num_nodes(other.num_nodes), DIMENSION(other.DIMENSION) {
+    other.owns_nodes = false;
 }
 
 Graph::~Graph() {
-    for (int i = 0; i < num_nodes; i++) {
-        delete[] nodes[i];
+    if (owns_nodes) {
+        free_nodes(nodes);
     }
-    delete[] nodes;
 }
 
 void Graph::to_files(Config* config, const string& graph_name) {
     // Export graph to file
     ofstream graph_file(config->runs_prefix + "graph_" + graph_name + ".bin");
 
-    // Export edges
+    // Map original IDs back to node indices so reordered graphs are saved in file order
+    vector<size_t> node_indices(num_nodes);
     for (size_t i = 0; i < num_nodes; ++i) {
+        node_indices[getOriginalId(i)] = i;
+    }
+
+    // Export edges
+    vector<uint32_t> original_neighbors(R);
+    for (size_t original = 0; original < num_nodes; ++original) {
         // Write number of neighbors
-        int num_neighbors = mappings[i].size();
+        size_t i = node_indices[original];
+        int num_neighbors = degrees[i];
         graph_file.write(reinterpret_cast<const char*>(&num_neighbors), sizeof(num_neighbors));
 
-        // Write index and distance of each neighbor
-        for (size_t neighbor : mappings[i]) {
-            graph_file.write(reinterpret_cast<const char*>(&neighbor), sizeof(neighbor));
+        // Write index of each neighbor
+        for (int j = 0; j < num_neighbors; ++j) {
+            original_neighbors[j] = getOriginalId(getNeighbors(i)[j]);
         }
+        graph_file.write(reinterpret_cast<const char*>(original_neighbors.data()), sizeof(uint32_t) * num_neighbors);
+    }
+
+    // Export start points after the edges
+    int num_starts = starts.size();
+    vector<uint32_t> original_starts(num_starts);
+    for (int j = 0; j < num_starts; ++j) {
+        original_starts[j] = getOriginalId(starts[j]);
     }
+    graph_file.write(reinterpret_cast<const char*>(&num_starts), sizeof(num_starts));
+    graph_file.write(reinterpret_cast<const char*>(original_starts.data()), sizeof(uint32_t) * num_starts);
     graph_file.close();
     cout << "Exported graph to " << config->runs_prefix + "graph_" + graph_name + ".bin" << endl;
 }
@@ -186,30 +183,120 @@ void Graph::from_files(Config* config, bool is_benchmarking) {
         return;
     }
 
-    // Process graph file
+    // Process graph file, widening the adjacency array if a node has more than R neighbors
+    vector<vector<uint32_t>> loaded(num_nodes);
+    int max_degree = R;
     for (int i = 0; i < num_nodes; ++i) {
         int num_neighbors;
         graph_file.read(reinterpret_cast<char*>(&num_neighbors), sizeof(num_neighbors));
-        // Load each neighbor
-        for (int j = 0; j < num_neighbors; ++j) {
-            int neighbor;
-            graph_file.read(reinterpret_cast<char*>(&neighbor), sizeof(neighbor));
-            mappings[i].insert(neighbor);
-        }
+        loaded[i].resize(num_neighbors);
+        graph_file.read(reinterpret_cast<char*>(loaded[i].data()), sizeof(uint32_t) * num_neighbors);
+        max_degree = max(max_degree, num_neighbors);
+    }
+    R = max_degree;
+    neighbors.assign(static_cast<size_t>(num_nodes) * R, 0);
+    for (int i = 0; i < num_nodes; ++i) {
+        setNeighbors(i, loaded[i]);
+    }
+
+    // Read the start points, or find them if the file was exported without them
+    int num_starts = 0;
+    if (graph_file.read(reinterpret_cast<char*>(&num_starts), sizeof(num_starts)) && num_starts > 0) {
+        starts.resize(num_starts);
+        graph_file.read(reinterpret_cast<char*>(starts.data()), sizeof(uint32_t) * num_starts);
+    } else {
+        starts = findStarts(config, *this, config->vamana_num_starts);
     }
 }
 
 
-void Graph::randomize(int R) {
+void Graph::randomize(int R, int seed) {
+    mt19937 gen(seed);
+    uniform_int_distribution<size_t> dis(0, num_nodes - 1);
     for (size_t i = 0; i < num_nodes; i++) {
-        set<size_t> neighbors = {};
+        degrees[i] = 0;
         for (size_t j = 0; j < R; j++) {
-            size_t random = rand() % num_nodes; // find a random node
-            while (random == i) random = rand() % num_nodes;
-            neighbors.insert(random);
+            size_t random = dis(gen); // find a random node
+            while (random == i) random = dis(gen);
+            if (degrees[i] < this->R && !hasEdge(i, random)) {
+                neighbors[i * this->R + degrees[i]++] = random;
+            }
+        }
+    }
+}
+
+bool Graph::hasEdge(size_t i, uint32_t neighbor) const {
+    const uint32_t* begin = getNeighbors(i);
+    return find(begin, begin + degrees[i], neighbor) != begin + degrees[i];
+}
+
+// Replaces the neighbors of node i, which must number at most R
+void Graph::setNeighbors(size_t i, const vector<uint32_t>& new_neighbors) {
+    copy(new_neighbors.begin(), new_neighbors.end(), neighbors.begin() + i * R);
+    degrees[i] = new_neighbors.size();
+}
+
+/**
+ * Relabels nodes with config->reorder_method, as HNSW::reorder_nodes does, so that
+ * neighbors sit close together in memory. The vectors are copied into a slab in
+ * the new order, leaving the caller's nodes untouched, and search, query and
+ * to_files translate back to original IDs. The first start point is the root of
+ * the traversal.
+ */
+void Graph::reorderNodes(Config* config) {
+    auto startTime = chrono::high_resolution_clock::now();
+    vector<vector<int>> adjacency(num_nodes);
+    for (size_t i = 0; i < num_nodes; ++i) {
+        adjacency[i].assign(getNeighbors(i), getNeighbors(i) + degrees[i]);
+    }
+    vector<int> order = get_node_order(config, adjacency, starts.empty() ? 0 : starts[0]);  // New index to old index
+    if (order.empty()) {
+        return;
+    }
+    vector<uint32_t> newIds(num_nodes);
+    for (size_t i = 0; i < num_nodes; ++i) {
+        newIds[order[i]] = i;
+    }
+
+    // Relabel the adjacency array and start points
+    vector<uint32_t> newNeighbors(neighbors.size());
+    vector<uint32_t> newDegrees(num_nodes);
+    for (size_t i = 0; i < num_nodes; ++i) {
+        const uint32_t* oldNeighbors = getNeighbors(order[i]);
+        newDegrees[i] = degrees[order[i]];
+        for (uint32_t j = 0; j < newDegrees[i]; ++j) {
+            newNeighbors[i * R + j] = newIds[oldNeighbors[j]];
         }
-        mappings[i] = neighbors;
     }
+    neighbors = std::move(newNeighbors);
+    degrees = std::move(newDegrees);
+    for (uint32_t& start : starts) {
+        start = newIds[start];
+    }
+
+    // Copy vectors into a slab in the new order, which free_nodes releases like a loaded one
+    float* slab = static_cast<float*>(allocate_index_memory(sizeof(float) * num_nodes * DIMENSION, config->use_huge_pages, config->compare_huge_pages));
+    float** newNodes = new float*[num_nodes];
+    for (size_t i = 0; i < num_nodes; ++i) {
+        newNodes[i] = slab + i * DIMENSION;
+        copy(nodes[order[i]], nodes[order[i]] + DIMENSION, newNodes[i]);
+    }
+    if (owns_nodes) {
+        free_nodes(nodes);
+    }
+    nodes = newNodes;
+    owns_nodes = true;
+
+    // Compose with any earlier reordering
+    vector<uint32_t> newOriginalIds(num_nodes);
+    for (size_t i = 0; i < num_nodes; ++i) {
+        newOriginalIds[i] = getOriginalId(order[i]);
+    }
+    original_ids = std::move(newOriginalIds);
+
+    auto endTime = chrono::high_resolution_clock::now();
+    cout << "Reordered nodes using method " << config->reorder_method << " in "
+         << chrono::duration_cast<chrono::milliseconds>(endTime - startTime).count() / 1000.0 << " seconds" << endl;
 }
 
 
@@ -219,6 +306,18 @@ float Graph::findDistance(size_t i, float* query) const {
     return calculate_l2_sq(nodes[i], query, DIMENSION);
 }
 
+// Computes the distances from the query to count nodes with the batched kernel, prefetching every vector first
+void Graph::findDistances(const uint32_t* ids, size_t count, float* query, float* distances) const {
+    static thread_local vector<float*> vectors;
+    vectors.resize(count);
+    for (size_t j = 0; j < count; j++) {
+        vectors[j] = nodes[ids[j]];
+        _mm_prefetch(reinterpret_cast<const char*>(vectors[j]), _MM_HINT_T0);
+    }
+    calculate_l2_sq_batch(query, vectors.data(), count, DIMENSION, distances);
+    distanceCalculationCount += count;
+}
+
 
 
 void Graph::sanityCheck(Config* config, const vector<vector<size_t>>& allResults) const {
@@ -232,54 +331,117 @@ void Graph::sanityCheck(Config* config, const vector<vector<size_t>>& allResults
     for (size_t j = 0; j < config->num_queries; j++) {
         int correct = 0;
         vector<size_t> allTruths = {};
-        for (size_t i = 0; i < K_TRUTH; i++) {
+        for (size_t i = 0; i < config->num_return; i++) {
             groundTruth >> each;
             allTruths.push_back(each);
         }
         vector<size_t> eachResult = {};
-        for (int count = 0; count < K_QUERY; count++) {
+        for (int count = 0; count < config->num_return; count++) {
             for (size_t ea : allResults[j]) {
                 if (allTruths[count] == ea) correct++;
             }
         }
-        result = correct * 100 / K_QUERY;
+        result = correct * 100 / config->num_return;
         totalCorrect += result;
-        cout << "Found " << result << "% among " << K_QUERY << " closest neighbors" << endl;
+        cout << "Found " << result << "% among " << config->num_return << " closest neighbors" << endl;
     }
     result = totalCorrect / config->num_queries;
     cout << "Average correctness: " << result << '%' << endl;
 }
 
-vector<vector<size_t>> Graph::query(Config* config, size_t start) {
-    fstream f;
-    f.open(config->query_file);
-    if (!f) {cout << "Query file not open" << endl;}
+/**
+ * Searches every query from config->query_file, or generated ones, timing each
+ * one and counting its distance computations and hops. Averages and latency
+ * percentiles are printed, and histograms are exported if enabled.
+ */
+vector<vector<size_t>> Graph::query(Config* config) {
     float** queries = new float*[config->num_queries];
-    double each;
-    for (size_t i = 0; i < config->num_queries; i++) {
-        queries[i] = new float[DIMENSION];
-        for (size_t j = 0; j < DIMENSION; j++) {
-            f >> each;
-            queries[i][j] = each;
-        }
-    }
+    load_queries(config, nodes, queries);
     cout << "All queries read" << endl;
-    vector<vector<size_t>> allResults = {};
+    vector<vector<size_t>> allResults(config->num_queries);
+    vector<long long int> calculations(config->num_queries);
+    vector<long long int> hops(config->num_queries);
+    vector<double> latencies(config->num_queries);
+    distanceTerminationCount = 0;
+    originalTerminationCount = 0;
     for (size_t k = 0; k < config->num_queries; k++) {
-        if (k % 1000 == 0) cout << "Processing " << k << endl;
-        float* thisQuery = queries[k];
+        long long int firstCalculation = distanceCalculationCount;
+        long long int firstHop = hopCount;
         auto startTime = std::chrono::high_resolution_clock::now();
-        vector<size_t> result = GreedySearch(*this, start, thisQuery, L_QUERY);
+        allResults[k] = search(config, queries[k]);
         auto endTime = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
-        allResults.push_back(result);
+        latencies[k] = std::chrono::duration<double, std::micro>(endTime - startTime).count();
+        calculations[k] = distanceCalculationCount - firstCalculation;
+        hops[k] = hopCount - firstHop;
     }
     cout << "All queries processed" << endl;
+
+    // Report averages and latency percentiles
+    long long int totalCalculations = 0;
+    long long int totalHops = 0;
+    double totalLatency = 0;
+    for (size_t k = 0; k < config->num_queries; k++) {
+        totalCalculations += calculations[k];
+        totalHops += hops[k];
+        totalLatency += latencies[k];
+    }
+    vector<double> sortedLatencies = latencies;
+    sort(sortedLatencies.begin(), sortedLatencies.end());
+    cout << "Distance computations per query: " << static_cast<double>(totalCalculations) / config->num_queries
+         << ", hops per query: " << static_cast<double>(totalHops) / config->num_queries << endl;
+    cout << "Latency per query: " << totalLatency / config->num_queries << " us, median "
+         << sortedLatencies[sortedLatencies.size() / 2] << " us, 99th percentile "
+         << sortedLatencies[sortedLatencies.size() * 99 / 100] << " us" << endl;
+    if (config->use_hybrid_termination) {
+        cout << "Terminated by distance: " << distanceTerminationCount << ", by beam width: " << originalTerminationCount << endl;
+    }
+
+    // Export histograms in the format of HNSW::search_queries
+    if (config->export_calcs_per_query) {
+        vector<int> counts(20, 0);
+        for (long long int calcs : calculations) {
+            ++counts[min(19LL, calcs / config->interval_for_calcs_histogram)];
+        }
+        ofstream histogram(config->runs_prefix + "histogram_calcs_per_query.txt", ios::app);
+        for (int count : counts) {
+            histogram << count << ",";
+        }
+        histogram << endl;
+    }
+    if (config->export_latency_per_query) {
+        vector<int> counts(20, 0);
+        for (double latency : latencies) {
+            ++counts[min(19, static_cast<int>(latency / config->interval_for_latency_histogram))];
+        }
+        ofstream histogram(config->runs_prefix + "histogram_latency_per_query.txt", ios::app);
+        for (int count : counts) {
+            histogram << count << ",";
+        }
+        histogram << endl;
+    }
+
+    for (size_t k = 0; k < config->num_queries; k++) {
+        delete[] queries[k];
+    }
+    delete[] queries;
     return allResults;
 }
 
+// Searches from the start points with beam width config->ef_search, returning the original IDs of the closest config->num_return nodes
+vector<size_t> Graph::search(Config* config, float* query, vector<float>* distances) {
+    vector<size_t> result = GreedySearch(*this, starts, query, max(config->ef_search, config->num_return), nullptr, distances, config);
+    result.resize(min(result.size(), static_cast<size_t>(config->num_return)));
+    for (size_t& id : result) {
+        id = getOriginalId(id);
+    }
+    if (distances != nullptr) {
+        distances->resize(result.size());
+    }
+    return result;
+}
+
 
-void Graph::queryTest(size_t start) {
+void Graph::queryTest(Config* config) {
     vector<float*> queryNodes = {};
     int queryCount = 0;
     size_t correct = 0;
@@ -291,7 +453,7 @@ void Graph::queryTest(size_t start) {
     for (float* each : queryNodes) {
 
         auto startTime = std::chrono::high_resolution_clock::now();
-        vector<size_t> result = GreedySearch(*this, start, each, L_QUERY);
+        vector<size_t> result = search(config, each);
         auto endTime = std::chrono::high_resolution_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime);
         size_t closestNode = 0;
@@ -304,25 +466,16 @@ void Graph::queryTest(size_t start) {
             }
         }
         for (auto i : result) {
-            if (i == closestNode) correct++;
+            if (i == getOriginalId(closestNode)) correct++;
         }
     }
     cout << "Total correct number: " << correct << endl;
 }
 
 void Graph::queryBruteForce(Config* config, size_t start) {
-    fstream f;
-    f.open(config->query_file);
-    if (!f) {cout << "Query file not open" << endl;}
     float** queries = new float*[config->num_queries];
+    load_queries(config, nodes, queries);
     float each;
-    for (size_t i = 0; i < config->num_queries; i++) {
-        queries[i] = new float[DIMENSION];
-        for (size_t j = 0; j < DIMENSION; j++) {
-            f >> each;
-            queries[i][j] = each;
-        }
-    }
     cout << "All queries read" << endl;
     
     fstream groundTruth;
@@ -332,7 +485,7 @@ void Graph::queryBruteForce(Config* config, size_t start) {
     float result;
     for (size_t j = 0; j < config->num_queries; j++) {
         vector<size_t> allTruths = {};
-        for (size_t i = 0; i < K_TRUTH; i++) {
+        for (size_t i = 0; i < config->num_return; i++) {
             groundTruth >> each;
             allTruths.push_back(each);
         }
@@ -346,7 +499,7 @@ void Graph::queryBruteForce(Config* config, size_t start) {
                 closestDist = newDist;
             }
         }
-        if (allTruths[0] == closest) {
+        if (allTruths[0] == getOriginalId(closest)) {
             totalCorrect++;
         } else {
             cout << allTruths[0] << ' ' << closest << endl;
@@ -356,167 +509,475 @@ void Graph::queryBruteForce(Config* config, size_t start) {
     cout << "Average correctness: " << result << '%' << endl;
 }
 
-/// L, V, diff between L and V
-/// L -> priority queue with distance and index
-/// V -> vector with inde
-/// diff -> priority queue with distance and index -> 
-vector<size_t> GreedySearch(Graph& graph, size_t start,  float* query, size_t L) {    
-    vector<size_t> result;
-    priority_queue<tuple<float, size_t>> List; // max priority queue
-    set<size_t> ListSet = {};
-    float distance = graph.findDistance(start,  query);
-    List.push({distance, start}); // L <- {s}
-    ListSet.insert(start);
-    vector<size_t> Visited = {};
-    priority_queue<tuple<float, size_t>> diff; // min priority queue
-    diff.push({-1 * distance, start});
-
-    while (diff.size() != 0) {
-        tuple<float, size_t> top = diff.top(); // get the best candidate
-        Visited.push_back(get<1>(top));
-        for (size_t j : graph.mappings[get<1>(top)]) {
-            float dist = graph.findDistance(j, query);
-            tuple<float, size_t> newNode = {dist, j};
-            bool inserted = false;
-           
-            if (ListSet.find(j) != ListSet.end()) {inserted = true;}
-            
-            if (!inserted) List.push(newNode);
-            ListSet.insert(j);
-        }
-
-        while (List.size() > L) List.pop();
-
-        priority_queue<tuple<float, size_t>> copy = List;
-        diff = {};
-        while (copy.size() != 0) {
-            tuple<float, size_t> next = copy.top();
-            copy.pop();
-            bool exists = false;
-            for (size_t k : Visited) {
-                if (k == get<1>(next)) exists = true;
+/**
+ * Returns whether a query search should end before expanding a node at squared
+ * distance close_squared, using the layer-0 criteria of HNSW::should_terminate.
+ * The num_found closest pooled nodes, at most config->num_return, are used as
+ * top-k, with the closest at top_1 and the furthest of them at top_k. Hops stand
+ * in for beam width, as candidates popped do in HNSW.
+ */
+static bool shouldTerminate(Config* config, float close_squared, float top_1, float top_k, size_t num_found, long long int hops, long long int calculations) {
+    bool beam_width_1 = hops > config->ef_search;
+    bool alpha_distance_1 = false;
+    bool alpha_distance_2 = false;
+    if (config->use_hybrid_termination || config->use_distance_termination) {
+        float close = sqrt(close_squared);
+        float threshold = config->always_top_1 ? 3 * sqrt(top_1) : 2 * sqrt(top_k) + sqrt(top_1);
+        float estimated_distance_calcs = config->bw_slope != 0 ? (config->ef_search - config->bw_intercept) / config->bw_slope : 1;
+        float termination_alpha = config->use_distance_termination ? config->termination_alpha : config->alpha_coefficient * log(estimated_distance_calcs) + config->alpha_intercept;
+        alpha_distance_1 = num_found >= config->num_return && close > termination_alpha * threshold;
+        if (config->use_latest && config->use_break) {
+            float termination_alpha2 = config->alpha_coefficient * log(config->alpha_break * estimated_distance_calcs) + config->alpha_intercept;
+            alpha_distance_2 = num_found >= config->num_return && close > termination_alpha2 * threshold;
+        }
+    }
+
+    if (config->use_hybrid_termination && config->use_latest) {
+        return (alpha_distance_1 && beam_width_1) || alpha_distance_2;
+    } else if (config->use_hybrid_termination) {
+        return alpha_distance_1 || beam_width_1;
+    } else if (config->use_distance_termination) {
+        return alpha_distance_1;
+    } else if (config->use_calculation_termination) {
+        return config->calculations_per_query < calculations;
+    }
+    return false;
+}
+
+/**
+ * Beam searches the graph from the start points, keeping the L closest nodes found in a pool
+ * sorted by distance. Each node's distance is computed once, when it is first
+ * seen, and the closest unexpanded node in the pool is expanded next. Returns the
+ * pool from closest to furthest, and appends each expanded node with its distance
+ * to visited if it is given, so that RobustPrune does not recompute them. The
+ * pool's distances are written to distances if it is given. Query searches pass
+ * config, which may end them early with a termination mode of HNSW.
+ */
+vector<size_t> GreedySearch(Graph& graph, const vector<uint32_t>& starts, float* query, size_t L, vector<pair<float, uint32_t>>* visited, vector<float>* distances, Config* config) {
+    // Mark seen nodes with the search's epoch, so the flags never need clearing
+    static thread_local vector<uint32_t> seen;
+    static thread_local uint32_t epoch = 0;
+    static thread_local vector<uint32_t> unseen;
+    static thread_local vector<float> unseen_distances;
+    if (seen.size() < graph.num_nodes) {
+        seen.assign(graph.num_nodes, 0);
+        epoch = 0;
+    }
+    if (++epoch == 0) {
+        fill(seen.begin(), seen.end(), 0);
+        epoch = 1;
+    }
+
+    struct Candidate {
+        float distance;
+        size_t id;
+        bool expanded;
+    };
+    // Queries ending on a distance or calculation criterion may expand any node found, as HNSW does, so
+    // unexpanded nodes are kept in a min-heap that the pool's bound does not prune
+    static thread_local vector<pair<float, size_t>> frontier;
+    bool is_unbounded = config != nullptr && (config->use_distance_termination || config->use_calculation_termination || config->use_hybrid_termination);
+    frontier.clear();
+    long long int firstCalculation = distanceCalculationCount;
+    long long int hops = 0;
+    vector<Candidate> pool;
+    pool.reserve(max(L, starts.size()) + 1);
+    unseen.clear();
+    for (uint32_t start : starts) {
+        if (seen[start] != epoch) {
+            seen[start] = epoch;
+            unseen.push_back(start);
+        }
+    }
+    unseen_distances.resize(unseen.size());
+    graph.findDistances(unseen.data(), unseen.size(), query, unseen_distances.data());
+    for (size_t j = 0; j < unseen.size(); j++) {
+        pool.push_back({unseen_distances[j], unseen[j], false});
+        if (is_unbounded) {
+            frontier.emplace_back(unseen_distances[j], unseen[j]);
+            push_heap(frontier.begin(), frontier.end(), greater<pair<float, size_t>>());
+        }
+    }
+    stable_sort(pool.begin(), pool.end(), [](const Candidate& lhs, const Candidate& rhs) { return lhs.distance < rhs.distance; });
+    pool.resize(min(pool.size(), max(L, static_cast<size_t>(1))));
+    size_t next = 0;
+    while (is_unbounded ? !frontier.empty() : next < pool.size()) {
+        float closest = is_unbounded ? frontier.front().first : pool[next].distance;
+        ++hops;
+        ++hopCount;
+        if (config != nullptr) {
+            size_t num_found = min(pool.size(), static_cast<size_t>(config->num_return));
+            if (shouldTerminate(config, closest, pool[0].distance, pool[num_found - 1].distance, num_found, hops,
+                                distanceCalculationCount - firstCalculation)) {
+                if (config->use_hybrid_termination && hops > config->ef_search) {
+                    ++originalTerminationCount;
+                } else if (config->use_hybrid_termination) {
+                    ++distanceTerminationCount;
+                }
+                break;
+            }
+        }
+        size_t current;
+        if (is_unbounded) {
+            current = frontier.front().second;
+            pop_heap(frontier.begin(), frontier.end(), greater<pair<float, size_t>>());
+            frontier.pop_back();
+        } else {
+            current = pool[next].id;
+            pool[next].expanded = true;
+        }
+        if (visited != nullptr) {
+            visited->emplace_back(closest, current);
+        }
+
+        // Gather unseen neighbors and compute their distances in one batch
+        const uint32_t* neighbors = graph.getNeighbors(current);
+        unseen.clear();
+        for (uint32_t j = 0; j < graph.getDegree(current); j++) {
+            if (seen[neighbors[j]] != epoch) {
+                seen[neighbors[j]] = epoch;
+                unseen.push_back(neighbors[j]);
+            }
+        }
+        unseen_distances.resize(unseen.size());
+        graph.findDistances(unseen.data(), unseen.size(), query, unseen_distances.data());
+
+        // Insert unseen neighbors that are closer than the furthest pooled node
+        size_t lowest_insert = pool.size();
+        for (size_t j = 0; j < unseen.size(); j++) {
+            size_t neighbor = unseen[j];
+            float distance = unseen_distances[j];
+            if (is_unbounded) {
+                frontier.emplace_back(distance, neighbor);
+                push_heap(frontier.begin(), frontier.end(), greater<pair<float, size_t>>());
+            }
+            if (pool.size() >= L && distance >= pool.back().distance) {
+                continue;
+            }
+            auto position = upper_bound(pool.begin(), pool.end(), distance,
+                                        [](float d, const Candidate& candidate) { return d < candidate.distance; });
+            lowest_insert = min(lowest_insert, static_cast<size_t>(position - pool.begin()));
+            pool.insert(position, {distance, neighbor, false});
+            if (pool.size() > L) {
+                pool.pop_back();
             }
-            if (!exists) diff.push({-1 * get<0>(next), get<1>(next)});
         }
+
+        // Nodes before next and before the first insertion are all expanded
+        next = min(next, lowest_insert);
+        while (next < pool.size() && pool[next].expanded) {
+            ++next;
+        }
+    }
+
+    vector<size_t> result;
+    result.reserve(pool.size());
+    for (const Candidate& candidate : pool) {
+        result.push_back(candidate.id);
     }
-    while (List.size() != 0) {
-        result.push_back(get<1>(List.top()));
-        List.pop();
+    if (distances != nullptr) {
+        distances->clear();
+        for (const Candidate& candidate : pool) {
+            distances->push_back(candidate.distance);
+        }
     }
     return result;
 }
 
-void RobustPrune(Graph& graph, size_t point, vector<size_t>& candidates, long threshold, int R) {
-    set<size_t> neighbors = graph.mappings[point];
-    for (size_t i : neighbors) {
-        candidates.push_back(i);
+/**
+ * Chooses up to R out-neighbors for point from the candidates and its current
+ * neighbors, given as (squared distance to point, ID) pairs. The candidates are
+ * sorted by distance once, then a single pass keeps each candidate that no kept
+ * neighbor occludes, i.e. alpha * d(kept, candidate) > d(point, candidate). The
+ * graph is not changed, so that points in one batch can be pruned in parallel.
+ */
+vector<uint32_t> RobustPrune(Graph& graph, size_t point, vector<pair<float, uint32_t>>& candidates, float alpha, int R) {
+    // Add the current neighbors, then drop duplicates and the point itself
+    size_t num_candidates = candidates.size();
+    uint32_t degree = graph.getDegree(point);
+    candidates.resize(num_candidates + degree);
+    vector<float> distances(degree);
+    graph.findDistances(graph.getNeighbors(point), degree, graph.nodes[point], distances.data());
+    for (uint32_t j = 0; j < degree; j++) {
+        candidates[num_candidates + j] = make_pair(distances[j], graph.getNeighbors(point)[j]);
     }
-    for (size_t j = 0; j < candidates.size(); j++) {
-        if (candidates[j] == point) {
-            candidates[j] = candidates[candidates.size()-1];
-            candidates.pop_back();
+    sort(candidates.begin(), candidates.end());
+    candidates.erase(unique(candidates.begin(), candidates.end(),
+                            [](const pair<float, uint32_t>& lhs, const pair<float, uint32_t>& rhs) { return lhs.second == rhs.second; }),
+                     candidates.end());
+
+    vector<uint32_t> edges;
+    edges.reserve(R);
+    for (const pair<float, uint32_t>& candidate : candidates) {
+        if (edges.size() == R) {
             break;
         }
-    }
-    graph.mappings[point] = {};
-    while (candidates.size() != 0) {
-        // find p* <- closest neighbor to p
-        size_t bestCandidate = *candidates.begin();
-        for (size_t j : candidates) {
-            if (graph.findDistance(j, graph.nodes[point]) < graph.findDistance(bestCandidate, graph.nodes[point])) {
-                bestCandidate = j;
-            }
+        if (candidate.second == point) {
+            continue;
         }
-        for (size_t j = 0; j < candidates.size(); j++) {
-            if (candidates[j] == bestCandidate) {
-                candidates[j] = candidates[candidates.size()-1];
-                candidates.pop_back();
+        bool is_occluded = false;
+        for (uint32_t kept : edges) {
+            if (alpha * graph.findDistance(kept, graph.nodes[candidate.second]) <= candidate.first) {
+                is_occluded = true;
                 break;
             }
         }
-        // add best candidate back to p's neighborhood
-        set<size_t> edges = graph.mappings[point];
-        edges.insert(bestCandidate);
-        graph.mappings[point] = edges;
-        // neighborhood is full
-        if (graph.mappings[point].size() == R) {
-            break;
+        if (!is_occluded) {
+            edges.push_back(candidate.second);
+        }
+    }
+    return edges;
+}
+
+// Adds a point to a double-precision sum, converting four dimensions at a time
+static void addPoint(double* sum, const float* point, int dimensions) {
+    int k = 0;
+    for (; k + 4 <= dimensions; k += 4) {
+        __m256d values = _mm256_cvtps_pd(_mm_loadu_ps(point + k));
+        _mm256_storeu_pd(sum + k, _mm256_add_pd(_mm256_loadu_pd(sum + k), values));
+    }
+    for (; k < dimensions; k++) {
+        sum[k] += point[k];
+    }
+}
+
+/**
+ * Averages the points assigned to each of the k clusters into centroids, leaving
+ * the centroid of an empty cluster unchanged. Points are summed in fixed-size
+ * chunks in parallel and the chunks are added in order, so the centroids do not
+ * depend on the number of threads. A null assignment puts every point in cluster 0.
+ */
+static void updateCentroids(const Graph& g, const int* assignment, int k, int num_threads, vector<float>& centroids) {
+    const size_t CHUNK = 16384;
+    size_t num_chunks = (g.num_nodes + CHUNK - 1) / CHUNK;
+    vector<double> sums(num_chunks * k * g.DIMENSION, 0);
+    vector<size_t> counts(num_chunks * k, 0);
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads)
+    for (size_t c = 0; c < num_chunks; c++) {
+        for (size_t j = c * CHUNK; j < min(static_cast<size_t>(g.num_nodes), (c + 1) * CHUNK); j++) {
+            int cluster = assignment == nullptr ? 0 : assignment[j];
+            addPoint(&sums[(c * k + cluster) * g.DIMENSION], g.nodes[j], g.DIMENSION);
+            counts[c * k + cluster]++;
         }
-        vector<size_t> copy;
-        for (size_t k : candidates) {
-            if (graph.findDistance(point, graph.nodes[k]) < threshold * graph.findDistance(bestCandidate, graph.nodes[k])) {
-                copy.push_back(k);
+    }
+    for (int cluster = 0; cluster < k; cluster++) {
+        vector<double> total(g.DIMENSION, 0);
+        size_t count = 0;
+        for (size_t c = 0; c < num_chunks; c++) {
+            for (int d = 0; d < g.DIMENSION; d++) {
+                total[d] += sums[(c * k + cluster) * g.DIMENSION + d];
+            }
+            count += counts[c * k + cluster];
+        }
+        if (count == 0) {
+            continue;
+        }
+        for (int d = 0; d < g.DIMENSION; d++) {
+            centroids[cluster * g.DIMENSION + d] = total[d] / count;
+        }
+    }
+}
+
+/**
+ * For every point, finds the nearest of the k centroids with the batched distance
+ * kernel. If nearest_points is given, it is set to the point nearest to each
+ * centroid, with ties going to the lowest ID whatever the number of threads.
+ */
+static void assignPoints(const Graph& g, vector<float>& centroids, int k, int num_threads, int* assignment, vector<uint32_t>* nearest_points) {
+    vector<float*> centroid_ptrs(k);
+    for (int cluster = 0; cluster < k; cluster++) {
+        centroid_ptrs[cluster] = &centroids[cluster * g.DIMENSION];
+    }
+    const size_t CHUNK = 16384;
+    size_t num_chunks = (g.num_nodes + CHUNK - 1) / CHUNK;
+    vector<pair<float, uint32_t>> chunk_nearest(num_chunks * k, make_pair(MAXFLOAT, 0));
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads)
+    for (size_t c = 0; c < num_chunks; c++) {
+        vector<float> distances(k);
+        for (size_t j = c * CHUNK; j < min(static_cast<size_t>(g.num_nodes), (c + 1) * CHUNK); j++) {
+            calculate_l2_sq_batch(g.nodes[j], centroid_ptrs.data(), k, g.DIMENSION, distances.data());
+            int best = min_element(distances.begin(), distances.end()) - distances.begin();
+            if (assignment != nullptr) {
+                assignment[j] = best;
+            }
+            for (int cluster = 0; cluster < k; cluster++) {
+                if (distances[cluster] < chunk_nearest[c * k + cluster].first) {
+                    chunk_nearest[c * k + cluster] = make_pair(distances[cluster], j);
+                }
+            }
+        }
+    }
+    if (nearest_points != nullptr) {
+        nearest_points->assign(k, 0);
+        for (int cluster = 0; cluster < k; cluster++) {
+            float nearest_dist = MAXFLOAT;
+            for (size_t c = 0; c < num_chunks; c++) {
+                if (chunk_nearest[c * k + cluster].first < nearest_dist) {
+                    nearest_dist = chunk_nearest[c * k + cluster].first;
+                    (*nearest_points)[cluster] = chunk_nearest[c * k + cluster].second;
+                }
             }
         }
-        candidates = copy;
     }
 }
 
+// Finds the point nearest to the centroid of the dataset
 size_t findStart(Config* config, const Graph& g) {
-    float* center = new float[g.DIMENSION];
-    for(size_t k = 0; k < g.DIMENSION; k++){
-        center[k] = 0; 
+    int num_threads = config->num_threads > 0 ? config->num_threads : omp_get_num_procs();
+    vector<float> center(g.DIMENSION, 0);
+    updateCentroids(g, nullptr, 1, num_threads, center);
+    vector<uint32_t> nearest;
+    assignPoints(g, center, 1, num_threads, nullptr, &nearest);
+    return nearest[0];
+}
+
+/**
+ * Finds num_starts diverse search start points. With one start this is the point
+ * nearest to the dataset centroid. Otherwise k-means is run from centroids seeded
+ * at random points, and the points nearest to the final centroids are returned,
+ * without duplicates and ordered by cluster.
+ */
+vector<uint32_t> findStarts(Config* config, const Graph& g, int num_starts) {
+    if (num_starts <= 1) {
+        return {static_cast<uint32_t>(findStart(config, g))};
     }
+    int num_threads = config->num_threads > 0 ? config->num_threads : omp_get_num_procs();
+    int k = min(num_starts, g.num_nodes);
+    vector<uint32_t> seeds(g.num_nodes);
     for (size_t j = 0; j < g.num_nodes; j++) {
-        for (size_t k = 0; k < g.DIMENSION; k++) {
-            center[k] += g.nodes[j][k];
+        seeds[j] = j;
+    }
+    shuffle(seeds.begin(), seeds.end(), mt19937(config->insertion_seed));
+    vector<float> centroids(static_cast<size_t>(k) * g.DIMENSION);
+    for (int cluster = 0; cluster < k; cluster++) {
+        copy(g.nodes[seeds[cluster]], g.nodes[seeds[cluster]] + g.DIMENSION, &centroids[cluster * g.DIMENSION]);
+    }
+
+    vector<int> assignment(g.num_nodes);
+    for (int iteration = 0; iteration < config->vamana_kmeans_iterations; iteration++) {
+        assignPoints(g, centroids, k, num_threads, assignment.data(), nullptr);
+        updateCentroids(g, assignment.data(), k, num_threads, centroids);
+    }
+    vector<uint32_t> nearest;
+    assignPoints(g, centroids, k, num_threads, nullptr, &nearest);
+
+    vector<uint32_t> starts;
+    for (uint32_t point : nearest) {
+        if (find(starts.begin(), starts.end(), point) == starts.end()) {
+            starts.push_back(point);
         }
     }
-    for (size_t i = 0; i < g.DIMENSION; i++) {
-        center[i] /= g.num_nodes;
+    return starts;
+}
+
+/**
+ * Inserts a batch of points into the graph. Every point is searched and pruned in
+ * parallel against the graph left by the previous batch and gets its pruned
+ * neighbors. The reverse edges are then sorted by target, so that each target's
+ * sources are merged in ID order and the graph does not depend on the number of
+ * threads, and merged in parallel, pruning targets that would exceed R.
+ */
+static void insertBatch(Graph& graph, const size_t* points, size_t count, float alpha, int L, int num_threads) {
+    // Search and prune every point in the batch against the current graph
+    vector<vector<uint32_t>> pruned(count);
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads)
+    for (size_t b = 0; b < count; b++) {
+        vector<pair<float, uint32_t>> visited;
+        GreedySearch(graph, graph.starts, graph.nodes[points[b]], L, &visited);
+        pruned[b] = RobustPrune(graph, points[b], visited, alpha, graph.R);
+    }
+
+    // Set the new neighbors and collect the reverse edges as (target, source) pairs
+    vector<pair<uint32_t, uint32_t>> reverse_edges;
+    for (size_t b = 0; b < count; b++) {
+        graph.setNeighbors(points[b], pruned[b]);
+        for (uint32_t j : pruned[b]) {
+            reverse_edges.emplace_back(j, points[b]);
+        }
     }
-    size_t closest = 0;
-    float closest_dist = MAXFLOAT;
-    for (size_t m = 0; m < g.num_nodes; m++) {
-        float this_dist = g.findDistance(m, center);
-        if (this_dist < closest_dist) {
-            closest_dist = this_dist;
-            closest = m;
+    sort(reverse_edges.begin(), reverse_edges.end());
+    vector<size_t> groups;
+    for (size_t e = 0; e < reverse_edges.size(); e++) {
+        if (e == 0 || reverse_edges[e].first != reverse_edges[e - 1].first) {
+            groups.push_back(e);
+        }
+    }
+    size_t num_targets = groups.size();
+    groups.push_back(reverse_edges.size());
+
+    // Merge the reverse edges of each target, pruning neighbors that would exceed R
+    #pragma omp parallel for schedule(dynamic, 64) num_threads(num_threads)
+    for (size_t g = 0; g < num_targets; g++) {
+        uint32_t j = reverse_edges[groups[g]].first;
+        vector<uint32_t> sources;
+        for (size_t e = groups[g]; e < groups[g + 1]; e++) {
+            if (!graph.hasEdge(j, reverse_edges[e].second)) {
+                sources.push_back(reverse_edges[e].second);
+            }
+        }
+        if (graph.getDegree(j) + sources.size() <= graph.R) {
+            vector<uint32_t> edges(graph.getNeighbors(j), graph.getNeighbors(j) + graph.getDegree(j));
+            edges.insert(edges.end(), sources.begin(), sources.end());
+            graph.setNeighbors(j, edges);
+        } else {
+            vector<float> distances(sources.size());
+            graph.findDistances(sources.data(), sources.size(), graph.nodes[j], distances.data());
+            vector<pair<float, uint32_t>> candidates(sources.size());
+            for (size_t k = 0; k < sources.size(); k++) {
+                candidates[k] = make_pair(distances[k], sources[k]);
+            }
+            graph.setNeighbors(j, RobustPrune(graph, j, candidates, alpha, graph.R));
         }
     }
-    return closest;
 }
 
-Graph Vamana(Config* config, long alpha, int L, int R) {
-    Graph graph(config);
+/**
+ * Builds the graph in two passes over a seeded random order of the points. Each
+ * pass inserts the points in batches that double in size up to
+ * config->vamana_max_batch_fraction of the nodes, so the graph only depends on
+ * config->insertion_seed and not on the number of threads.
+ */
+void buildVamana(Config* config, Graph& graph, float alpha, int L) {
+    int num_threads = config->num_threads > 0 ? config->num_threads : omp_get_num_procs();
     cout << "Start of Vamana" << endl;
     cout << "Randomizing edges" << endl;
-    graph.randomize(R);
+    graph.randomize(graph.R, config->insertion_seed);
     cout << "Randomized edges" << endl;
     cout << "Random graph: " << endl;
-    size_t s = findStart(config, graph);
-    cout << "The centroid is #" << s << endl;
+    graph.starts = findStarts(config, graph, config->vamana_num_starts);
+    cout << "The start points are";
+    for (uint32_t start : graph.starts) {
+        cout << " #" << start;
+    }
+    cout << endl;
+    size_t max_batch = max(1.0f, config->vamana_max_batch_fraction * graph.num_nodes);
     for (int i = 0; i < 2; i++) {
-        long actual_alpha = (i == 0) ? 1 : alpha;
+        float actual_alpha = (i == 0) ? 1 : alpha;
         vector<size_t> sigma;
-        for (size_t i = 0; i < config->num_nodes; i++) {
+        for (size_t i = 0; i < graph.num_nodes; i++) {
             sigma.push_back(i);
         }
-        unsigned seed = chrono::system_clock::now().time_since_epoch().count();
-        shuffle(sigma.begin(), sigma.end(), default_random_engine(seed));
-        size_t count = 0;
-        for (size_t i : sigma) {
-            if (count % 1000 == 0) cout << "Num of node processed: " << count << endl;
-            count++;
-            vector<size_t> result = GreedySearch(graph, s, graph.nodes[i], L);
-            RobustPrune(graph, i, result, actual_alpha, R);
-            set<size_t> neighbors = graph.mappings[i];
-            for (size_t j : neighbors) {
-                set<size_t> unionV = graph.mappings[j]; 
-                vector<size_t> unionVec;
-                for (size_t i : unionV) {
-                    unionVec.push_back(i);
-                }
-                unionV.insert(i);
-                if (unionV.size() > R) {
-                    RobustPrune(graph, j, unionVec, actual_alpha, R);
-                } else {
-                    graph.mappings[j]= unionV;
-                }
+        shuffle(sigma.begin(), sigma.end(), mt19937(config->insertion_seed + i));
+        for (size_t batch_start = 0; batch_start < sigma.size(); ) {
+            size_t batch_end = min(sigma.size(), batch_start + min(max_batch, max(batch_start, static_cast<size_t>(1))));
+            insertBatch(graph, &sigma[batch_start], batch_end - batch_start, actual_alpha, L, num_threads);
+            if (batch_end / 100000 != batch_start / 100000) {
+                cout << "Num of node processed: " << batch_end << endl;
             }
+            batch_start = batch_end;
         }
     }
     cout << "End of Vamana" << endl;
+}
+
+// Links point into a built graph with one search, prune, and reverse-edge merge, as a batch of one
+void insertVamana(Graph& graph, size_t point, float alpha, int L) {
+    insertBatch(graph, &point, 1, alpha, L, 1);
+}
+
+Graph Vamana(Config* config, float alpha, int L, int R) {
+    Graph graph(config, R);
+    buildVamana(config, graph, alpha, L);
     return graph;
 }
 
@@ -3,8 +3,8 @@
 
 #include <iostream>
 #include <vector>
-#include <set>
 #include <string>
+#include <cstdint>
 #include "utils.h"
 #include "../config.h"
 
@@ -31,34 +31,64 @@
 //     std::set<size_t> outEdge;
 // };
 
+/**
+ * Vamana graph stored as a flat adjacency array with R slots per node and a
+ * degree count for each node.
+ */
 class Graph {
     friend std::ostream& operator<<(std::ostream& os, const Graph& rhs);
 public:
     // Node* allNodes;
     float** nodes;
-    std::vector<std::set<size_t>> mappings;
+    bool owns_nodes;  // Whether nodes was loaded or reordered by the graph and is freed with it
+    std::vector<uint32_t> neighbors;  // Node index * R, then neighbor IDs
+    std::vector<uint32_t> degrees;
+    std::vector<uint32_t> starts;  // Search start points, found during construction or loaded with the graph
+    std::vector<uint32_t> original_ids;  // Node index to index in the loaded vectors, empty unless reordered
+    int R;  // Max out-degree
     int num_nodes;
     int DIMENSION;
 
-    Graph(Config* config);
+    Graph(Config* config, int R);
+    Graph(Config* config, float** nodes, int R);
+    Graph(const Graph&) = delete;
+    Graph& operator=(const Graph&) = delete;
+    Graph(Graph&& other);
     ~Graph();
     void to_files(Config* config, const std::string& graph_name);
     void from_files(Config* config, bool is_benchmarking = false);
-    void randomize(int R);
+    void randomize(int R, int seed);
     float findDistance(size_t i, float* query) const;
-    void setEdge(size_t i, std::set<size_t> edges);
-    std::vector<std::vector<size_t>> query(Config* config, size_t start);
+    void findDistances(const uint32_t* ids, size_t count, float* query, float* distances) const;
+    const uint32_t* getNeighbors(size_t i) const { return neighbors.data() + i * R; }
+    uint32_t getDegree(size_t i) const { return degrees[i]; }
+    bool hasEdge(size_t i, uint32_t neighbor) const;
+    void setNeighbors(size_t i, const std::vector<uint32_t>& new_neighbors);
+    size_t getOriginalId(size_t i) const { return original_ids.empty() ? i : original_ids[i]; }
+    void reorderNodes(Config* config);
+    std::vector<size_t> search(Config* config, float* query, std::vector<float>* distances = nullptr);
+    std::vector<std::vector<size_t>> query(Config* config);
     void queryBruteForce(Config* config, size_t start);
     void sanityCheck(Config* config, const std::vector<std::vector<size_t>>& allResults) const;
-    void queryTest(size_t start);
+    void queryTest(Config* config);
    
 };
 
+// Search counters kept by each thread, so that queries can run in parallel
+extern thread_local long long int distanceCalculationCount;
+extern thread_local long long int hopCount;  // Nodes expanded by searches
+extern thread_local long long int distanceTerminationCount;  // Hybrid-terminated queries that ended on the distance criterion
+extern thread_local long long int originalTerminationCount;  // Hybrid-terminated queries that ended on the beam width
+
 void randomEdges(Graph& graph, int R);
-std::vector<size_t> GreedySearch(Graph& graph, size_t start, float* query, size_t L);
-void RobustPrune(Graph& graph, size_t point, std::vector<size_t>& candidates, long threshold, int R);
-Graph Vamana(Config* config, long alpha, int L, int R);
+std::vector<size_t> GreedySearch(Graph& graph, const std::vector<uint32_t>& starts, float* query, size_t L, std::vector<std::pair<float, uint32_t>>* visited = nullptr,
+                                 std::vector<float>* distances = nullptr, Config* config = nullptr);
+std::vector<uint32_t> RobustPrune(Graph& graph, size_t point, std::vector<std::pair<float, uint32_t>>& candidates, float alpha, int R);
+void buildVamana(Config* config, Graph& graph, float alpha, int L);
+void insertVamana(Graph& graph, size_t point, float alpha, int L);
+Graph Vamana(Config* config, float alpha, int L, int R);
 size_t findStart(Config* config, const Graph& g);
+std::vector<uint32_t> findStarts(Config* config, const Graph& g, int num_starts);
 void print_100_nodes(const Graph& g, Config* config);
 
 #endif
\ No newline at end of file